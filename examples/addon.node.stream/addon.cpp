@@ -2,27 +2,42 @@
 #include <SDL2/SDL_audio.h>
 #include <napi.h>
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "common-sdl_2.h"
 #include "common.h"
+#include "session_manager.h"
+#include "utterance_queue.h"
 #include "utils.h"
+#include "vad.h"
 #include "whisper.h"
 
-class WhisperWorker : public Napi::AsyncProgressWorker<std::string> {
+// a transcribed segment together with the state of the utterance queue
+struct stream_segment {
+    std::string text;
+    size_t n_queued = 0;
+    size_t n_dropped = 0;
+};
+
+class WhisperWorker : public Napi::AsyncProgressWorker<stream_segment> {
 public:
-    WhisperWorker(Napi::Function& callback, whisper_params& params)
-        : Napi::AsyncProgressWorker<std::string>(callback)
+    // input - audio written by JS with audio_async::push(), nullptr to capture from the SDL device
+    WhisperWorker(Napi::Function& callback, whisper_params& params, std::shared_ptr<audio_async> input = nullptr)
+        : Napi::AsyncProgressWorker<stream_segment>(callback)
         , params(params)
-        , shouldStop(false)
+        , input(std::move(input))
+        , stopFlag(std::make_shared<std::atomic<bool>>(false))
+        , shouldStop(*stopFlag)
     {
     }
 
@@ -30,74 +45,68 @@ public:
     {
         shouldStop = true;
     }
-    ~WhisperWorker()
+
+    // stop() for JS - it owns the flag instead of pointing to the worker, which is deleted after
+    // OnOK() / OnError() while JS may still call stop(), and then it does nothing
+    Napi::Function StopFunction(Napi::Env env) const
     {
+        std::shared_ptr<std::atomic<bool>> flag = stopFlag;
+        return Napi::Function::New(env, [flag](const Napi::CallbackInfo& info) { *flag = true; });
     }
 
-    bool vad_detection(std::vector<float>& pcmf32, int sample_rate, int last_ms, float vad_thold, float freq_thold,
-        bool wait_for_fade_out, bool verbose)
+    ~WhisperWorker()
     {
-        // fprintf(stdout, "!!!!!!!!!!!: %f", vad_thold);
-        const int n_samples = pcmf32.size();
-        const int n_samples_last = (sample_rate * last_ms) / 1000;
-
-        // not enough samples - assume no speec
-        if (n_samples_last >= n_samples)
-            return false;
-
-        if (freq_thold > 0.0f)
-            high_pass_filter(pcmf32, freq_thold, sample_rate);
-
-        float energy_all = 0.0f;
-        float energy_last = 0.0f;
+    }
 
-        for (int i = 0; i < n_samples; i++) {
-            energy_all += fabsf(pcmf32[i]);
-            if (i >= n_samples - n_samples_last) {
-                energy_last += fabsf(pcmf32[i]);
-            }
+    // Capture -> VAD/segmenter -> transcribe pipeline
+    //
+    // The SDL callback fills the capture ring, Segment() runs on its own thread and cuts the
+    // audio into utterances, Execute() transcribes them. The stages are decoupled by a bounded
+    // utterance_queue, so the VAD keeps tracking the audio while whisper_full() runs.
+    void Execute(const ExecutionProgress& progress) override
+    {
+        utterance_drop_policy drop_policy = utterance_drop_policy::DROP_OLDEST;
+        if (!utterance_drop_policy_from_str(params.drop_policy, drop_policy)) {
+            SetError("Unknown drop_policy: " + params.drop_policy);
+            return;
         }
 
-        energy_all /= n_samples;
-        energy_last /= n_samples_last;
-
-        if (verbose) {
-            log_debug(__func__, energy_all, energy_last, vad_thold, freq_thold);
+        if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
+            SetError("Unknown language: " + params.language);
+            return;
         }
 
-        // Подобранное пороговое значение для минимальной энергии
-        const float min_energy_threshold = 0.000130f;
-
-        bool speech_detected = wait_for_fade_out
-            ? energy_last <= vad_thold * energy_all // Если ждем окончания речи, речь
-                                                    // завершается, когда энергия падает
-            : energy_last > vad_thold * energy_all && energy_last > min_energy_threshold; // В противном случае
-                                                                                          // речь обнаруживается,
-                                                                                          // если превышен порог
-
-        return speech_detected;
-    }
+        // the weights are shared with the other sessions on the same model, the state is ours
+        std::shared_ptr<stream_model> model = stream_model_acquire(params);
+        if (!model) {
+            SetError("Failed to load model: " + params.model);
+            return;
+        }
 
-    void Execute(const ExecutionProgress& progress) override
-    {
-        // Initialize Whisper context
-        ctx = init_whisper_context(params, 0, nullptr);
+        whisper_context* ctx = model->ctx();
 
-        // audio_async audio(params.hard_ms_th, 0.0040f);
-        audio_async audio(params.hard_ms_th);
-        if (!audio.init(params.capture_id, WHISPER_SAMPLE_RATE)) {
-            SetError("Audio initialization failed");
+        std::unique_ptr<whisper_state, decltype(&whisper_free_state)> state(whisper_init_state(ctx), whisper_free_state);
+        if (!state) {
+            SetError("Failed to initialize whisper state");
             return;
         }
-        audio.resume();
 
-        std::vector<float> pcmf32(n_samples_40s, 0.0f);
-        std::vector<float> pcmf32_old;
-        std::vector<float> pcmf32_new(n_samples_30s, 0.0f);
-        std::vector<float> pcmf32_zcr(n_samples_30s, 0.0f);
+        // PCM streams are written by JS, otherwise capture from the SDL device
+        std::shared_ptr<audio_async> audio = input;
+        if (!audio) {
+            // audio_async audio(params.hard_ms_th, 0.0040f);
+            audio = std::make_shared<audio_async>(params.hard_ms_th);
+            if (!audio->init(params.capture_id, WHISPER_SAMPLE_RATE)) {
+                SetError("Audio initialization failed");
+                return;
+            }
+            audio->resume();
+        }
+
+        utterance_queue queue(params.queue_depth, drop_policy);
+
         std::vector<whisper_token> prompt_tokens;
         print_processing_info(ctx, params, n_samples_step, n_samples_len, n_samples_keep, use_vad, n_new_line);
-        const auto t_start = std::chrono::high_resolution_clock::now();
         whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
         wparams.print_progress = false;
@@ -117,14 +126,144 @@ public:
 
         wparams.temperature_inc = params.no_fallback ? 0.0f : wparams.temperature_inc;
 
+        wparams.encoder_batch = model->encoder_batch();
+        wparams.decoder_batch = model->decoder_batch();
+
         wparams.prompt_tokens = params.no_context ? nullptr : prompt_tokens.data();
         wparams.prompt_n_tokens = params.no_context ? 0 : prompt_tokens.size();
         // wparams.debug_mode = true;
 
+        // in step mode consecutive windows overlap, so the mel columns are computed incrementally
+        // mel_seq is the capture position the mel stream has been fed up to
+        size_t mel_seq = 0;
+        if (!use_vad) {
+            whisper_stream_mel_reset_with_state(ctx, state.get(), params.keep_ms + params.soft_ms_th);
+        }
+
+        std::thread segmenter([&]() { Segment(*audio, queue); });
+
+        // stop the segmenter and wait for it, before the capture goes away
+        const auto stop_segmenter = [&]() {
+            shouldStop = true;
+            queue.close();
+            segmenter.join();
+        };
+
+        utterance item;
+
+        while (queue.pop(item) && !shouldStop) {
+            std::vector<float>& pcmf32 = item.pcmf32;
+
+            // Stage 3: Transcribe
+
+            // Stage 3.1:
+            // If data is less than 1000ms, add silence up to 1000ms
+            const int required_size = static_cast<int>((1000.0 / 1000.0) * WHISPER_SAMPLE_RATE);
+
+            // Проверяем, нужно ли добавить нули
+            if (pcmf32.size() <= required_size) {
+                // Вычисляем количество нулей, которые нужно добавить
+                fprintf(stdout, "[[ 🚨🚨 %d ms %zu,  %d]]", static_cast<int>((pcmf32.size() / static_cast<float>(WHISPER_SAMPLE_RATE)) * 1000.0f), pcmf32.size(), required_size);
+
+                // save_to_wav("output.wav", pcmf32, 16000);
+                // exit(0);
+
+                int zeros_to_add = required_size - pcmf32.size();
+
+                fprintf(stdout, "==%d==", zeros_to_add);
+
+                // Создаем вектор с нулями (значениями 0.0020)
+                std::vector<float> zeros(zeros_to_add + 100, 0.0020f);
+
+                // Добавляем нули в конец вектора pcmf32
+                pcmf32.insert(pcmf32.end(), zeros.begin(), zeros.end());
+            }
+
+            auto w_start = std::chrono::high_resolution_clock::now();
+
+            // the step window is the tail of the mel stream - reuse the already computed columns
+            const bool use_stream_mel = !use_vad && !wparams.speed_up && (int)pcmf32.size() > required_size;
+            if (use_stream_mel) {
+                if (item.seq - item.n_new == mel_seq) {
+                    whisper_stream_mel_push_with_state(ctx, state.get(), pcmf32.data() + pcmf32.size() - item.n_new, item.n_new);
+                } else {
+                    // a step was dropped before it reached us - restart the stream from this window
+                    whisper_stream_mel_reset_with_state(ctx, state.get(), params.keep_ms + params.soft_ms_th);
+                    whisper_stream_mel_push_with_state(ctx, state.get(), pcmf32.data(), pcmf32.size());
+                }
+                mel_seq = item.seq;
+
+                if (whisper_stream_mel_window_with_state(ctx, state.get(), pcmf32.size()) != 0) {
+                    stop_segmenter();
+                    SetError("Failed to process audio: whisper_stream_mel_window");
+                    return;
+                }
+            }
+
+            // a short utterance does not pay for the attention over 30 s of encoder context
+            if (params.audio_ctx <= 0 && params.adaptive_audio_ctx) {
+                wparams.audio_ctx = adaptive_audio_ctx(pcmf32.size(), whisper_n_audio_ctx(ctx), wparams.speed_up);
+            }
+
+            int ret = 0;
+            {
+                // wait for our turn among the sessions sharing the model
+                stream_model::turn turn(*model);
+                ret = whisper_full_with_state(ctx, state.get(), wparams, use_stream_mel ? nullptr : pcmf32.data(), use_stream_mel ? 0 : pcmf32.size());
+            }
+
+            if (ret != 0) {
+                fprintf(stdout, "Error: problem during invocation of 'whisper_full'\n");
+                stop_segmenter();
+                SetError("Failed to process audio: whisper_full");
+                return;
+            }
+
+            int executed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - w_start).count();
+
+            // Stage 3.2:
+            // Send the transcription results to the main thread
+            const int n_segments = whisper_full_n_segments_from_state(state.get());
+            const int time_since_last = item.time_since_last;
+
+            // fprintf(stdout, "Segments - %d \n", n_segments);
+            for (int i = 0; i < n_segments; ++i) {
+                const char* text = whisper_full_get_segment_text_from_state(state.get(), i);
+
+                stream_segment segment;
+                segment.text = text;
+                segment.n_queued = queue.size();
+                segment.n_dropped = queue.n_dropped();
+
+                fprintf(stdout, "[%d, %d, %d] #%d: ✅ %s \n", time_since_last, executed, time_since_last - executed, i, text);
+
+                progress.Send(&segment, 1);
+            }
+        }
+
+        // Clean up
+        stop_segmenter();
+
+        audio->pause();
+
+    }
+
+    // Stage 1 and 2 of the pipeline: wait for audio, detect voice and push the utterances to the queue
+    void Segment(audio_async& audio, utterance_queue& queue)
+    {
+        std::vector<float> pcmf32;
+        std::vector<float> pcmf32_old;
+
+        const auto t_start = std::chrono::high_resolution_clock::now();
+
         // Определите значения по умолчанию
         const int default_vad_window = 1000;
         const int min_last_ms = 120;
         const int decrement_ms = 100;
+        // new audio that triggers the next VAD check
+        const int vad_step_ms = 50;
+        // the longest the loop blocks on the capture before it checks for Stop()
+        const int stop_check_ms = 250;
         // const int max_ms = 7000;  // Максимальное время для транскрипции, 10
         // секунд
         int vad_window_ms = default_vad_window;
@@ -133,28 +272,45 @@ public:
 
         bool zcr_detect = false;
 
+        // capture position up to which the audio was consumed by the step / fed to the VAD
+        size_t step_seq = 0;
+        size_t vad_seq = 0;
+
+        // fed with every captured sample once, so a VAD check costs O(new samples)
+        audio_vad vad(WHISPER_SAMPLE_RATE, 2000, params.freq_thold, default_vad_window);
+
         std::this_thread::sleep_for(std::chrono::milliseconds(1000));
         fprintf(stdout, "Start transcribing...\n");
 
         while (!shouldStop) {
-            // Process audio and transcribe
+            utterance item;
+
+            // Process audio
             if (!use_vad) {
                 // if (!use_vad) {
-                while (true) {
-                    audio.get(params.step_ms, pcmf32_new);
-                    if ((int)pcmf32_new.size() > 2 * n_samples_step) {
+                audio_view pcmf32_new;
+                while (!shouldStop) {
+                    // block until the next step of audio is captured
+                    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(stop_check_ms);
+                    if (!audio.wait(step_seq, params.step_ms, deadline)) {
+                        continue;
+                    }
+                    // everything captured since the last step, up to two steps of it
+                    pcmf32_new = audio.view_since(step_seq);
+                    if (pcmf32_new.size() > 2 * (size_t)n_samples_step) {
                         fprintf(stderr,
                             "\n\n%s: WARNING: cannot process audio fast enough, "
                             "dropping audio ...\n\n",
                             __func__);
                         audio.clear();
+                        step_seq = audio.seq();
                         continue;
                     }
-                    if ((int)pcmf32_new.size() >= n_samples_step) {
-                        audio.clear();
-                        break;
-                    }
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    break;
+                }
+
+                if (shouldStop) {
+                    break;
                 }
 
                 const int n_samples_new = pcmf32_new.size();
@@ -166,21 +322,54 @@ public:
                     pcmf32[i] = pcmf32_old[pcmf32_old.size() - n_samples_take + i];
                 }
 
-                memcpy(pcmf32.data() + n_samples_take, pcmf32_new.data(), n_samples_new * sizeof(float));
+                pcmf32_new.copy_to(pcmf32.data() + n_samples_take);
+
+                if (!audio.valid(pcmf32_new)) {
+                    fprintf(stderr, "\n\n%s: WARNING: audio overwritten while reading, dropping audio ...\n\n", __func__);
+                    audio.clear();
+                    step_seq = audio.seq();
+                    continue;
+                }
+
+                // samples captured after the view stay for the next step
+                audio.clear(pcmf32_new);
+                step_seq = pcmf32_new.seq;
 
                 pcmf32_old = pcmf32;
+
+                item.seq = pcmf32_new.seq;
+                item.n_new = n_samples_new;
+                time_since_last = (n_samples_new * 1000) / WHISPER_SAMPLE_RATE;
             } else {
                 // Stage 1: Waiting
                 const auto t_now = std::chrono::high_resolution_clock::now();
                 const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_start).count();
 
                 if (t_diff < 1000) {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    std::this_thread::sleep_until(t_start + std::chrono::milliseconds(1000));
                     continue;
                 }
 
+                // Stage 1.1: block until new audio is captured or the hard threshold is reached
+                {
+                    const auto ms_to_hard = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        last_sample_time + std::chrono::milliseconds(params.hard_ms_th) - std::chrono::high_resolution_clock::now())
+                                                .count();
+                    const auto wait_ms = std::max<int64_t>(0, std::min<int64_t>(ms_to_hard, stop_check_ms));
+
+                    const bool has_audio = audio.wait(vad_seq, vad_step_ms, std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms));
+                    if (!has_audio && ms_to_hard > stop_check_ms) {
+                        // woke up only to check for Stop()
+                        continue;
+                    }
+
+                    const audio_view pcmf32_new = audio.view_since(vad_seq);
+                    vad.push(pcmf32_new);
+                    vad_seq = pcmf32_new.seq;
+                }
+
                 // Stage 2: Voice Detect (VAD)
-                // Stage 2.1 get sample for VAD
+                // Stage 2.1 window for VAD
                 const auto vad_sample_ms = time_since_last == 0
                     ? 2000
                     : std::min(2000,
@@ -189,9 +378,7 @@ public:
                                   std::chrono::high_resolution_clock::now() - last_sample_time)
                                   .count()));
 
-                audio.get(vad_sample_ms, pcmf32_new);
-
-                const bool voice_fade_out_detect = vad_detection(pcmf32_new, WHISPER_SAMPLE_RATE, vad_window_ms, params.vad_thold, params.freq_thold, true, false);
+                const bool voice_fade_out_detect = vad.fade_out(vad_sample_ms, vad_window_ms, params.vad_thold);
 
                 time_since_last = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
                     std::chrono::high_resolution_clock::now() - last_sample_time)
@@ -216,14 +403,14 @@ public:
                     audio.get(std::max(capture_ms, vad_window_ms), pcmf32, true);
 
                     if (over_load) {
-                        auto zcr_detect = vad_detection_windowed_zcr(pcmf32, WHISPER_SAMPLE_RATE, default_vad_window, (params.vad_thold / 10), false);
+                        auto zcr_detect = vad.zcr_max() > (params.vad_thold / 10);
 
                         // fprintf(stdout, "[[ 🚨: %d/%d %s]]", capture_ms, params.hard_ms_th, zcr_detect ? "🎧 " : "X");
 
                         if (!zcr_detect) {
 
                             last_sample_time = std::chrono::high_resolution_clock::now(); // Сохранить время
-                            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                            vad.reset_utterance();
                             vad_window_ms = default_vad_window;
                             continue;
                         }
@@ -240,24 +427,20 @@ public:
                     // save_to_wav("output.wav", pcmf32, 16000);
 
                     last_sample_time = std::chrono::high_resolution_clock::now(); // Сохранить время
+                    vad.reset_utterance();
 
                     // Сбросить окно паузы на значение по умолчанию
                     vad_window_ms = default_vad_window;
                 } else {
                     // Stage 2.1 change the vad windows if need and continue if no vad detected
 
-                    audio.get(time_since_last, pcmf32_zcr);
-
-                    zcr_detect = vad_detection_windowed_zcr(pcmf32_zcr, WHISPER_SAMPLE_RATE, time_since_last,
-                        (params.vad_thold / 20), false);
-
-                    if (zcr_detect) {
-                        fprintf(stdout, "ZCR  time_since_last:%d, vad_window_ms: %d \n", time_since_last, vad_window_ms);
-                    }
+                    zcr_detect = vad.zcr_max() > (params.vad_thold / 20);
 
                     // Уменьшить окно паузы, но не ниже минимального
                     if (zcr_detect && (vad_window_ms > min_last_ms) && time_since_last > params.soft_ms_th) {
                         vad_window_ms = std::max(vad_window_ms - decrement_ms, min_last_ms);
+
+                        fprintf(stdout, "ZCR  time_since_last:%d, vad_window_ms: %d \n", time_since_last, vad_window_ms);
                     }
 
                     if (time_since_last > params.hard_ms_th) {
@@ -271,8 +454,7 @@ public:
                     //         elapsed_ms, vad_window_ms,  params.hard_ms_th,
                     //         params.soft_ms_th);
 
-                    // wait for next iteration
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    // the next iteration blocks until new audio is captured
 
                     // time_since_last = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
                     //     std::chrono::high_resolution_clock::now() - last_sample_time);
@@ -280,72 +462,37 @@ public:
                 }
             }
 
-            // Stage 3: Transcribe
-
-            // Stage 3.1:
-            // If data is less than 1000ms, add silence up to 1000ms
-            const int required_size = static_cast<int>((1000.0 / 1000.0) * WHISPER_SAMPLE_RATE);
-
-            // Проверяем, нужно ли добавить нули
-            if (pcmf32.size() <= required_size) {
-                // Вычисляем количество нулей, которые нужно добавить
-                fprintf(stdout, "[[ 🚨🚨 %d ms %zu,  %d]]", static_cast<int>((pcmf32.size() / static_cast<float>(WHISPER_SAMPLE_RATE)) * 1000.0f), pcmf32.size(), required_size);
-
-                // save_to_wav("output.wav", pcmf32, 16000);
-                // exit(0);
-
-                int zeros_to_add = required_size - pcmf32.size();
-
-                fprintf(stdout, "==%d==", zeros_to_add);
-
-                // Создаем вектор с нулями (значениями 0.0020)
-                std::vector<float> zeros(zeros_to_add + 100, 0.0020f);
-
-                // Добавляем нули в конец вектора pcmf32
-                pcmf32.insert(pcmf32.end(), zeros.begin(), zeros.end());
-            }
 
-            auto w_start = std::chrono::high_resolution_clock::now();
-
-            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
-                fprintf(stdout, "Error: problem during invocation of 'whisper_full'\n");
-                SetError("Failed to process audio: whisper_full");
-                return;
+            if (use_vad) {
+                item.pcmf32.swap(pcmf32);
+            } else {
+                item.pcmf32 = pcmf32;
             }
+            item.time_since_last = time_since_last;
 
-            int executed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - w_start).count();
-
-            // Stage 3.2:
-            // Send the transcription results to the main thread
-            const int n_segments = whisper_full_n_segments(ctx);
-
-            // fprintf(stdout, "Segments - %d \n", n_segments);
-            for (int i = 0; i < n_segments; ++i) {
-                const char* text = whisper_full_get_segment_text(ctx, i);
-                std::string segment_text(text);
-                fprintf(stdout, "[%d, %d, %d] #%d: ✅ %s \n", time_since_last, executed, time_since_last - executed, i, text);
-
-                progress.Send(&segment_text, 1);
+            // Stage 2.3: hand the utterance over to the inference thread
+            if (!queue.push(std::move(item)) && !shouldStop) {
+                fprintf(stderr, "%s: WARNING: transcription is behind, dropped an utterance (%zu so far)\n", __func__, queue.n_dropped());
             }
         }
 
-        // Clean up
-        audio.pause();
-
-        whisper_print_timings(ctx);
-        whisper_free(ctx);
+        queue.close();
     }
 
-    void OnProgress(const std::string* segment, size_t count) override
+    void OnProgress(const stream_segment* segment, size_t count) override
     {
         Napi::Env env = Env();
         Napi::HandleScope scope(env);
 
         Napi::Object obj = Napi::Object::New(env);
-        obj.Set("text", Napi::String::New(env, *segment));
+        obj.Set("text", Napi::String::New(env, segment->text));
+
+        // backpressure of the pipeline - utterances waiting for transcription and dropped so far
+        obj.Set("queued", Napi::Number::New(env, segment->n_queued));
+        obj.Set("dropped", Napi::Number::New(env, segment->n_dropped));
 
         // Include the Stop function in the object sent to the callback
-        Napi::Function stopFunction = Napi::Function::New(env, [this](const Napi::CallbackInfo& info) { this->Stop(); });
+        Napi::Function stopFunction = StopFunction(env);
         obj.Set("stop",
             stopFunction); // Added stop method directly to the callback object
 
@@ -354,37 +501,23 @@ public:
 
 private:
     whisper_params params;
-    whisper_context* ctx;
 
-    bool shouldStop;
+    std::shared_ptr<audio_async> input;
+
+    std::shared_ptr<std::atomic<bool>> stopFlag;
+    std::atomic<bool>& shouldStop;
 
     const int n_samples_step = (1e-3 * params.step_ms) * WHISPER_SAMPLE_RATE;
     const int n_samples_len = (1e-3 * params.soft_ms_th) * WHISPER_SAMPLE_RATE;
     const int n_samples_keep = (1e-3 * params.keep_ms) * WHISPER_SAMPLE_RATE;
-    const int n_samples_30s = (1e-3 * 30000.0) * WHISPER_SAMPLE_RATE;
-    const int n_samples_40s = (1e-3 * 40000.0) * WHISPER_SAMPLE_RATE;
 
     const bool use_vad = n_samples_step <= 0;
     const int n_new_line = !use_vad ? std::max(1, params.soft_ms_th / params.step_ms - 1) : 1;
 };
 
-Napi::Value TranscribeAudio(const Napi::CallbackInfo& info)
+// read the transcription parameters from the JS object
+static whisper_params parse_params(const Napi::Object& obj)
 {
-    Napi::Env env = info.Env();
-
-    if (info.Length() < 2) {
-        Napi::TypeError::New(env, "Wrong number of arguments").ThrowAsJavaScriptException();
-        return env.Null();
-    }
-
-    if (!info[0].IsObject() || !info[1].IsFunction()) {
-        Napi::TypeError::New(env, "Wrong arguments").ThrowAsJavaScriptException();
-        return env.Null();
-    }
-
-    Napi::Object obj = info[0].ToObject();
-    Napi::Function callback = info[1].As<Napi::Function>();
-
     // Extract parameters from the object
     int32_t n_threads = obj.Has("n_threads") ? obj.Get("n_threads").As<Napi::Number>().Int32Value() : 4;
     int32_t step_ms = obj.Has("step_ms") ? obj.Get("step_ms").As<Napi::Number>().Int32Value() : 3000;
@@ -398,6 +531,11 @@ Napi::Value TranscribeAudio(const Napi::CallbackInfo& info)
     bool translate = obj.Has("translate") ? obj.Get("translate").As<Napi::Boolean>().Value() : false;
     bool use_gpu = obj.Has("use_gpu") ? obj.Get("use_gpu").As<Napi::Boolean>().Value() : true;
     float vad_thold = obj.Has("vad_thold") ? obj.Get("vad_thold").As<Napi::Number>().FloatValue() : 0.6f;
+    int32_t queue_depth = obj.Has("queue_depth") ? obj.Get("queue_depth").As<Napi::Number>().Int32Value() : 4;
+    int32_t n_parallel = obj.Has("n_parallel") ? obj.Get("n_parallel").As<Napi::Number>().Int32Value() : 1;
+    int32_t audio_ctx = obj.Has("audio_ctx") ? obj.Get("audio_ctx").As<Napi::Number>().Int32Value() : 0;
+    bool adaptive_audio_ctx = obj.Has("adaptive_audio_ctx") ? obj.Get("adaptive_audio_ctx").As<Napi::Boolean>().Value() : true;
+    std::string drop_policy = obj.Has("drop_policy") ? obj.Get("drop_policy").As<Napi::String>().Utf8Value() : "oldest";
 
     whisper_params params;
     params.use_gpu = use_gpu;
@@ -419,12 +557,40 @@ Napi::Value TranscribeAudio(const Napi::CallbackInfo& info)
     params.no_context = false;
     params.max_tokens = 0;
     params.vad_thold = vad_thold;
+    params.queue_depth = queue_depth;
+    params.drop_policy = drop_policy;
+    params.n_parallel = n_parallel;
+    params.audio_ctx = audio_ctx;
+    params.adaptive_audio_ctx = adaptive_audio_ctx;
+
+    return params;
+}
+
+Napi::Value TranscribeAudio(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2) {
+        Napi::TypeError::New(env, "Wrong number of arguments").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!info[0].IsObject() || !info[1].IsFunction()) {
+        Napi::TypeError::New(env, "Wrong arguments").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::Object obj = info[0].ToObject();
+    Napi::Function callback = info[1].As<Napi::Function>();
+
+    whisper_params params = parse_params(obj);
 
     WhisperWorker* worker = new WhisperWorker(callback, params);
-    worker->Queue();
 
     // Создаем функцию обратного вызова для остановки работы
-    Napi::Function stopFunction = Napi::Function::New(env, [worker](const Napi::CallbackInfo& info) { worker->Stop(); });
+    Napi::Function stopFunction = worker->StopFunction(env);
+
+    worker->Queue();
 
     // Передаем функцию обратного вызова в JavaScript
     Napi::Object n_obj = Napi::Object::New(env);
@@ -432,9 +598,78 @@ Napi::Value TranscribeAudio(const Napi::CallbackInfo& info)
     return n_obj;
 }
 
+// Transcribe PCM written from JS instead of an SDL capture device
+//
+// Returns { push(chunk), stop() }. push() takes a Float32Array or Int16Array of 16 kHz mono samples
+// and writes it straight from its ArrayBuffer into the capture ring, which feeds the same VAD and
+// transcription pipeline as the microphone. Returns the number of samples written.
+Napi::Value CreatePcmStream(const Napi::CallbackInfo& info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2) {
+        Napi::TypeError::New(env, "Wrong number of arguments").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!info[0].IsObject() || !info[1].IsFunction()) {
+        Napi::TypeError::New(env, "Wrong arguments").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::Object obj = info[0].ToObject();
+    Napi::Function callback = info[1].As<Napi::Function>();
+
+    whisper_params params = parse_params(obj);
+
+    std::shared_ptr<audio_async> input = std::make_shared<audio_async>(params.hard_ms_th);
+    input->init_push(WHISPER_SAMPLE_RATE);
+    input->resume();
+
+    WhisperWorker* worker = new WhisperWorker(callback, params, input);
+
+    // the worker is not touched after Queue(), it is deleted once it completes
+    Napi::Function stopFunction = worker->StopFunction(env);
+
+    worker->Queue();
+
+    Napi::Function pushFunction = Napi::Function::New(env, [input](const Napi::CallbackInfo& info) -> Napi::Value {
+        Napi::Env env = info.Env();
+
+        if (info.Length() < 1 || !info[0].IsTypedArray()) {
+            Napi::TypeError::New(env, "Expected a Float32Array or an Int16Array").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        size_t n_written = 0;
+
+        switch (info[0].As<Napi::TypedArray>().TypedArrayType()) {
+        case napi_float32_array: {
+            Napi::Float32Array chunk = info[0].As<Napi::Float32Array>();
+            n_written = input->push(chunk.Data(), chunk.ElementLength());
+        } break;
+        case napi_int16_array: {
+            Napi::Int16Array chunk = info[0].As<Napi::Int16Array>();
+            n_written = input->push(chunk.Data(), chunk.ElementLength());
+        } break;
+        default:
+            Napi::TypeError::New(env, "Expected a Float32Array or an Int16Array").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        return Napi::Number::New(env, n_written);
+    });
+
+    Napi::Object n_obj = Napi::Object::New(env);
+    n_obj.Set("push", pushFunction);
+    n_obj.Set("stop", stopFunction);
+    return n_obj;
+}
+
 Napi::Object Init(Napi::Env env, Napi::Object exports)
 {
     exports.Set(Napi::String::New(env, "transcribeAudio"), Napi::Function::New(env, TranscribeAudio));
+    exports.Set(Napi::String::New(env, "createPcmStream"), Napi::Function::New(env, CreatePcmStream));
     return exports;
 }
 
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+//
+// Read-only view of captured audio without copying
+//
+// The capture ring may wrap inside the viewed window, so the samples are
+// data[0][0 .. n[0]) followed by data[1][0 .. n[1]).
+// seq is the number of samples captured up to the end of the view.
+//
+
+struct audio_view {
+  const float* data[2] = {nullptr, nullptr};
+  size_t n[2] = {0, 0};
+  size_t seq = 0;
+
+  audio_view() = default;
+  explicit audio_view(const std::vector<float>& pcmf32) {
+    data[0] = pcmf32.data();
+    n[0] = pcmf32.size();
+    seq = pcmf32.size();
+  }
+
+  size_t size() const { return n[0] + n[1]; }
+
+  float operator[](size_t i) const {
+    return i < n[0] ? data[0][i] : data[1][i - n[0]];
+  }
+
+  // copy the samples to dst, which must hold size() floats
+  void copy_to(float* dst) const {
+    if (n[0] > 0) memcpy(dst, data[0], n[0] * sizeof(float));
+    if (n[1] > 0) memcpy(dst + n[0], data[1], n[1] * sizeof(float));
+  }
+};
@@ -1,10 +1,119 @@
 #include "common-sdl_2.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iomanip>
 #include <iostream>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define AUDIO_ASYNC_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 // #include "common-sdl.h"
 
+#if defined(_WIN32)
+
+audio_semaphore::audio_semaphore() {
+  m_handle = CreateSemaphoreA(nullptr, 0, MAXLONG, nullptr);
+}
+
+audio_semaphore::~audio_semaphore() { CloseHandle((HANDLE)m_handle); }
+
+void audio_semaphore::post() { ReleaseSemaphore((HANDLE)m_handle, 1, nullptr); }
+
+void audio_semaphore::wait() {
+  WaitForSingleObject((HANDLE)m_handle, INFINITE);
+}
+
+bool audio_semaphore::wait_until(
+    std::chrono::steady_clock::time_point deadline) {
+  const auto now = std::chrono::steady_clock::now();
+  // rounded up, so a timeout never returns before the deadline
+  const DWORD timeout_ms =
+      deadline > now
+          ? (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - now)
+                    .count() +
+                1
+          : 0;
+  return WaitForSingleObject((HANDLE)m_handle, timeout_ms) == WAIT_OBJECT_0;
+}
+
+#elif defined(__APPLE__)
+
+// unnamed POSIX semaphores are not supported on macOS
+audio_semaphore::audio_semaphore() { m_sem = dispatch_semaphore_create(0); }
+
+audio_semaphore::~audio_semaphore() { dispatch_release(m_sem); }
+
+void audio_semaphore::post() { dispatch_semaphore_signal(m_sem); }
+
+void audio_semaphore::wait() {
+  dispatch_semaphore_wait(m_sem, DISPATCH_TIME_FOREVER);
+}
+
+bool audio_semaphore::wait_until(
+    std::chrono::steady_clock::time_point deadline) {
+  const auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      deadline - std::chrono::steady_clock::now());
+  return dispatch_semaphore_wait(
+             m_sem, dispatch_time(DISPATCH_TIME_NOW,
+                                  std::max<int64_t>(0, remaining.count()))) == 0;
+}
+
+#else
+
+audio_semaphore::audio_semaphore() { sem_init(&m_sem, 0, 0); }
+
+audio_semaphore::~audio_semaphore() { sem_destroy(&m_sem); }
+
+void audio_semaphore::post() { sem_post(&m_sem); }
+
+void audio_semaphore::wait() {
+  while (sem_wait(&m_sem) != 0 && errno == EINTR) {
+  }
+}
+
+bool audio_semaphore::wait_until(
+    std::chrono::steady_clock::time_point deadline) {
+  // sem_timedwait() takes a CLOCK_REALTIME time, so only the remaining time is
+  // carried over from the steady clock
+  const auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      deadline - std::chrono::steady_clock::now());
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  const int64_t ns = (int64_t)ts.tv_nsec +
+                     std::max<int64_t>(0, remaining.count());
+  ts.tv_sec += (time_t)(ns / 1000000000);
+  ts.tv_nsec = (long)(ns % 1000000000);
+
+  int ret;
+  while ((ret = sem_timedwait(&m_sem, &ts)) != 0 && errno == EINTR) {
+  }
+
+  return ret == 0;
+}
+
+#endif
+
 audio_async::audio_async(int len_ms, float silence_th) {
   m_len_ms = len_ms;
   m_silence_th = silence_th;
@@ -106,15 +215,79 @@ bool audio_async::init(int capture_id, int sample_rate) {
             capture_spec_obtained.samples);
   }
 
-  m_sample_rate = capture_spec_obtained.freq;
+  init_ring(capture_spec_obtained.freq);
 
-  m_audio.resize((m_sample_rate * m_len_ms) / 1000);
+  return true;
+}
+
+bool audio_async::init_push(int sample_rate) {
+  if (sample_rate <= 0) {
+    fprintf(stderr, "%s: invalid sample rate %d\n", __func__, sample_rate);
+    return false;
+  }
+
+  m_push = true;
+
+  init_ring(sample_rate);
 
   return true;
 }
 
+void audio_async::init_ring(int sample_rate) {
+  m_sample_rate = sample_rate;
+
+  m_audio_window = (m_sample_rate * m_len_ms) / 1000;
+
+  size_t n_ring = 1;
+  while (n_ring < m_audio_window + m_sample_rate) {
+    n_ring *= 2;
+  }
+
+  m_audio.resize(n_ring);
+  m_audio_mask = n_ring - 1;
+}
+
+size_t audio_async::push(const float* samples, size_t n_samples) {
+  if (!m_push || !m_running) {
+    return 0;
+  }
+
+  // only the last len_ms fit in the window
+  if (n_samples > m_audio_window) {
+    samples += n_samples - m_audio_window;
+    n_samples = m_audio_window;
+  }
+
+  write(samples, n_samples);
+
+  return n_samples;
+}
+
+size_t audio_async::push(const int16_t* samples, size_t n_samples) {
+  if (!m_push || !m_running) {
+    return 0;
+  }
+
+  if (n_samples > m_audio_window) {
+    samples += n_samples - m_audio_window;
+    n_samples = m_audio_window;
+  }
+
+  // convert straight into the ring
+  const size_t head = m_audio_head.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < n_samples; ++i) {
+    m_audio[(head + i) & m_audio_mask] = samples[i] / 32768.0f;
+  }
+
+  m_audio_head.store(head + n_samples, std::memory_order_release);
+
+  notify(head + n_samples);
+
+  return n_samples;
+}
+
 bool audio_async::resume() {
-  if (!m_dev_id_in) {
+  if (!m_dev_id_in && !m_push) {
     fprintf(stderr, "%s: no audio device to resume!\n", __func__);
     return false;
   }
@@ -124,7 +297,9 @@ bool audio_async::resume() {
     return false;
   }
 
-  SDL_PauseAudioDevice(m_dev_id_in, 0);
+  if (m_dev_id_in) {
+    SDL_PauseAudioDevice(m_dev_id_in, 0);
+  }
 
   m_running = true;
 
@@ -132,7 +307,7 @@ bool audio_async::resume() {
 }
 
 bool audio_async::pause() {
-  if (!m_dev_id_in) {
+  if (!m_dev_id_in && !m_push) {
     fprintf(stderr, "%s: no audio device to pause!\n", __func__);
     return false;
   }
@@ -142,15 +317,22 @@ bool audio_async::pause() {
     return false;
   }
 
-  SDL_PauseAudioDevice(m_dev_id_in, 1);
+  if (m_dev_id_in) {
+    SDL_PauseAudioDevice(m_dev_id_in, 1);
+  }
 
   m_running = false;
 
+  // wake wait(), it sees that the capture is paused
+  if (m_wait_armed.exchange(false)) {
+    m_wait_sem.post();
+  }
+
   return true;
 }
 
 bool audio_async::clear() {
-  if (!m_dev_id_in) {
+  if (!m_dev_id_in && !m_push) {
     fprintf(stderr, "%s: no audio device to clear!\n", __func__);
     return false;
   }
@@ -160,11 +342,25 @@ bool audio_async::clear() {
     return false;
   }
 
-  {
-    std::lock_guard<std::mutex> lock(m_mutex);
+  m_audio_tail.store(m_audio_head.load(std::memory_order_acquire),
+                     std::memory_order_relaxed);
 
-    m_audio_pos = 0;
-    m_audio_len = 0;
+  return true;
+}
+
+bool audio_async::clear(const audio_view& view) {
+  if (!m_dev_id_in && !m_push) {
+    fprintf(stderr, "%s: no audio device to clear!\n", __func__);
+    return false;
+  }
+
+  if (!m_running) {
+    fprintf(stderr, "%s: not running!\n", __func__);
+    return false;
+  }
+
+  if (view.seq > m_audio_tail.load(std::memory_order_relaxed)) {
+    m_audio_tail.store(view.seq, std::memory_order_relaxed);
   }
 
   return true;
@@ -196,6 +392,149 @@ void audio_async::print_energy() {
   std::cout << "]" << std::endl;
 }
 
+void audio_async::write(const float* samples, size_t n_samples) {
+  const size_t head = m_audio_head.load(std::memory_order_relaxed);
+  const size_t pos = head & m_audio_mask;
+  const size_t n0 = std::min(n_samples, m_audio.size() - pos);
+
+  memcpy(&m_audio[pos], samples, n0 * sizeof(float));
+  memcpy(&m_audio[0], samples + n0, (n_samples - n0) * sizeof(float));
+
+  m_audio_head.store(head + n_samples, std::memory_order_release);
+
+  notify(head + n_samples);
+}
+
+void audio_async::write_fill(float value, size_t n_samples) {
+  const size_t head = m_audio_head.load(std::memory_order_relaxed);
+  const size_t pos = head & m_audio_mask;
+  const size_t n0 = std::min(n_samples, m_audio.size() - pos);
+
+  std::fill(m_audio.begin() + pos, m_audio.begin() + pos + n0, value);
+  std::fill(m_audio.begin(), m_audio.begin() + (n_samples - n0), value);
+
+  m_audio_head.store(head + n_samples, std::memory_order_release);
+
+  notify(head + n_samples);
+}
+
+void audio_async::notify(size_t head) {
+  // pairs with the store of the armed flag and the load of the head in wait()
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (!m_wait_armed.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  const size_t target = m_wait_target.load(std::memory_order_relaxed);
+  if ((std::ptrdiff_t)(head - target) < 0) {
+    return;
+  }
+
+  // no lock on the audio thread - the post never blocks, and only the side
+  // that clears the armed flag posts, so a wait() consumes at most one post
+  if (m_wait_armed.exchange(false)) {
+    m_wait_sem.post();
+  }
+}
+
+bool audio_async::wait(size_t seq, int ms,
+                       std::chrono::steady_clock::time_point deadline) {
+  const size_t target = seq + (m_sample_rate * ms) / 1000;
+
+  const auto ready = [&]() {
+    return (std::ptrdiff_t)(m_audio_head.load(std::memory_order_seq_cst) -
+                            target) >= 0;
+  };
+
+  // take back the armed flag, or the post of whoever cleared it first
+  const auto disarm = [&]() {
+    if (!m_wait_armed.exchange(false)) {
+      m_wait_sem.wait();
+    }
+  };
+
+  while (!ready() && m_running) {
+    m_wait_target.store(target, std::memory_order_relaxed);
+    m_wait_armed.store(true, std::memory_order_seq_cst);
+
+    // the head may have reached the target before the callback saw the flag
+    if (ready() || !m_running) {
+      disarm();
+      break;
+    }
+
+    // sleep until the callback or pause() posts, without a periodic wakeup
+    if (!m_wait_sem.wait_until(deadline)) {
+      disarm();
+      break;
+    }
+  }
+
+  return ready();
+}
+
+// root mean square of the samples
+// called from the SDL audio thread, so it only touches the samples
+static float audio_rms(const float* samples, size_t n_samples) {
+  if (n_samples == 0) {
+    return 0.0f;
+  }
+
+  size_t i = 0;
+  float sum = 0.0f;
+
+#if defined(__AVX__)
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for (; i + 16 <= n_samples; i += 16) {
+    const __m256 x0 = _mm256_loadu_ps(samples + i);
+    const __m256 x1 = _mm256_loadu_ps(samples + i + 8);
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(x0, x0));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(x1, x1));
+  }
+  float tmp[8];
+  _mm256_storeu_ps(tmp, _mm256_add_ps(acc0, acc1));
+  for (int k = 0; k < 8; ++k) {
+    sum += tmp[k];
+  }
+#elif defined(AUDIO_ASYNC_SSE)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (; i + 8 <= n_samples; i += 8) {
+    const __m128 x0 = _mm_loadu_ps(samples + i);
+    const __m128 x1 = _mm_loadu_ps(samples + i + 4);
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(x0, x0));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(x1, x1));
+  }
+  float tmp[4];
+  _mm_storeu_ps(tmp, _mm_add_ps(acc0, acc1));
+  for (int k = 0; k < 4; ++k) {
+    sum += tmp[k];
+  }
+#elif defined(__ARM_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0.0f);
+  float32x4_t acc1 = vdupq_n_f32(0.0f);
+  for (; i + 8 <= n_samples; i += 8) {
+    const float32x4_t x0 = vld1q_f32(samples + i);
+    const float32x4_t x1 = vld1q_f32(samples + i + 4);
+    acc0 = vmlaq_f32(acc0, x0, x0);
+    acc1 = vmlaq_f32(acc1, x1, x1);
+  }
+  float tmp[4];
+  vst1q_f32(tmp, vaddq_f32(acc0, acc1));
+  for (int k = 0; k < 4; ++k) {
+    sum += tmp[k];
+  }
+#endif
+
+  for (; i < n_samples; ++i) {
+    sum += samples[i] * samples[i];
+  }
+
+  return std::sqrt(sum / n_samples);
+}
+
 // callback to be called by SDL
 // void audio_async::callback(uint8_t* stream, int len) {
 
@@ -206,41 +545,21 @@ void audio_async::callback(uint8_t* stream, int len) {
 
   size_t n_samples = len / sizeof(float);
 
-  if (n_samples > m_audio.size()) {
-    n_samples = m_audio.size();
+  if (n_samples > m_audio_window) {
+    n_samples = m_audio_window;
 
     stream += (len - (n_samples * sizeof(float)));
   }
 
-  // fprintf(stderr, "%s: %zu samples, pos %zu, len %zu\n", __func__, n_samples,
-  // m_audio_pos, m_audio_len);
+  // fprintf(stderr, "%s: %zu samples, head %zu\n", __func__, n_samples,
+  // m_audio_head.load());
 
-  {
-    std::lock_guard<std::mutex> lock(m_mutex);
-
-    if (m_audio_pos + n_samples > m_audio.size()) {
-      const size_t n0 = m_audio.size() - m_audio_pos;
-
-      memcpy(&m_audio[m_audio_pos], stream, n0 * sizeof(float));
-      memcpy(&m_audio[0], stream + n0 * sizeof(float),
-             (n_samples - n0) * sizeof(float));
-
-      m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-      m_audio_len = m_audio.size();
-    } else {
-      memcpy(&m_audio[m_audio_pos], stream, n_samples * sizeof(float));
-
-      m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-      m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
-    }
-  }
+  write((const float*)stream, n_samples);
   // print_energy();
 }
 
 int audio_async::get_total_silence_ms() {
-  int result = m_total_skipped_ms;
-  m_total_skipped_ms = 0;
-  return result;
+  return m_total_skipped_ms.exchange(0);
 }
 
 void audio_async::callback_ignore_silence(uint8_t* stream, int len) {
@@ -250,43 +569,22 @@ void audio_async::callback_ignore_silence(uint8_t* stream, int len) {
 
   size_t n_samples = len / sizeof(float);
 
-  if (n_samples > m_audio.size()) {
-    n_samples = m_audio.size();
+  if (n_samples > m_audio_window) {
+    n_samples = m_audio_window;
 
     stream += (len - (n_samples * sizeof(float)));
   }
 
-  std::vector<float> temp_buffer(n_samples);
-  memcpy(temp_buffer.data(), stream, n_samples * sizeof(float));
+  // this runs on the SDL audio thread - no allocations, locks or stdio here
+  const float* samples = (const float*)stream;
 
-  float energy = 0.0f;
-  for (const auto& sample : temp_buffer) {
-    energy += sample * sample;
-  }
-  energy = std::sqrt(energy / temp_buffer.size());
+  const float energy = audio_rms(samples, n_samples);
 
   // static bool is_filled = false;  // Локальная переменная is_filled
 
   if (energy >= m_silence_th) {
     // Если энергия выше порога, записываем семплы в буфер
-    std::lock_guard<std::mutex> lock(m_mutex);
-
-    if (m_audio_pos + n_samples > m_audio.size()) {
-      const size_t n0 = m_audio.size() - m_audio_pos;
-
-      memcpy(&m_audio[m_audio_pos], temp_buffer.data(), n0 * sizeof(float));
-      memcpy(&m_audio[0], temp_buffer.data() + n0,
-             (n_samples - n0) * sizeof(float));
-
-      m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-      m_audio_len = m_audio.size();
-    } else {
-      memcpy(&m_audio[m_audio_pos], temp_buffer.data(),
-             n_samples * sizeof(float));
-
-      m_audio_pos = (m_audio_pos + n_samples) % m_audio.size();
-      m_audio_len = std::min(m_audio_len + n_samples, m_audio.size());
-    }
+    write(samples, n_samples);
 
     m_current_silence_ms = 0;  // Сбрасываем счетчик тишины
     m_is_filled = false;  // Сбрасываем флаг заполнения буфера
@@ -294,37 +592,21 @@ void audio_async::callback_ignore_silence(uint8_t* stream, int len) {
     // Если энергия ниже порога, увеличиваем счетчик тишины
     int silence_ms = (n_samples * 1000) / m_sample_rate;
     m_current_silence_ms += silence_ms;
-    m_total_skipped_ms += silence_ms;
+    m_total_skipped_ms.fetch_add(silence_ms, std::memory_order_relaxed);
     const int ms_to_fill = 700;
 
     if (m_current_silence_ms >= ms_to_fill && !m_is_filled) {
-      fprintf(stdout, "[  ]");
-      m_total_skipped_ms = m_total_skipped_ms - ms_to_fill;
+      m_total_skipped_ms.fetch_sub(ms_to_fill, std::memory_order_relaxed);
       // Если пауза тишины длится 700 мс или более и буфер еще не был заполнен,
       // заполняем буфер значениями 0.0020f
-      std::lock_guard<std::mutex> lock(m_mutex);
-
       size_t fill_samples = (m_sample_rate * ms_to_fill) / 1000;
-      if (fill_samples > m_audio.size()) {
-        fill_samples = m_audio.size();
+      if (fill_samples > m_audio_window) {
+        fill_samples = m_audio_window;
       }
 
       const float filler = 0.0020f;
 
-      if (m_audio_pos + fill_samples > m_audio.size()) {
-        const size_t n0 = m_audio.size() - m_audio_pos;
-        std::fill(&m_audio[m_audio_pos], &m_audio[m_audio_pos] + n0, filler);
-        std::fill(&m_audio[0], &m_audio[fill_samples - n0], filler);
-
-        m_audio_pos = (m_audio_pos + fill_samples) % m_audio.size();
-        m_audio_len = m_audio.size();
-      } else {
-        std::fill(&m_audio[m_audio_pos], &m_audio[m_audio_pos] + fill_samples,
-                  filler);
-
-        m_audio_pos = (m_audio_pos + fill_samples) % m_audio.size();
-        m_audio_len = std::min(m_audio_len + fill_samples, m_audio.size());
-      }
+      write_fill(filler, fill_samples);
 
       m_is_filled = true;  // Устанавливаем флаг заполнения буфера
       m_current_silence_ms = 0;
@@ -333,7 +615,7 @@ void audio_async::callback_ignore_silence(uint8_t* stream, int len) {
 }
 
 int audio_async::get(int ms, std::vector<float>& result, bool return_silence) {
-  if (!m_dev_id_in) {
+  if (!m_dev_id_in && !m_push) {
     fprintf(stderr, "%s: no audio device to get audio from!\n", __func__);
     return 0;
   }
@@ -346,36 +628,20 @@ int audio_async::get(int ms, std::vector<float>& result, bool return_silence) {
   result.clear();
 
   {
-    std::lock_guard<std::mutex> lock(m_mutex);
+    const audio_view v = view(ms);
 
-    if (ms <= 0) {
-      ms = m_len_ms;
-    }
+    result.resize(v.size());
+    v.copy_to(result.data());
 
-    size_t n_samples = (m_sample_rate * ms) / 1000;
-    if (n_samples > m_audio_len) {
-      n_samples = m_audio_len;
-    }
-
-    result.resize(n_samples);
-
-    int s0 = m_audio_pos - n_samples;
-    if (s0 < 0) {
-      s0 += m_audio.size();
-    }
-
-    if (s0 + n_samples > m_audio.size()) {
-      const size_t n0 = m_audio.size() - s0;
-
-      memcpy(result.data(), &m_audio[s0], n0 * sizeof(float));
-      memcpy(&result[n0], &m_audio[0], (n_samples - n0) * sizeof(float));
-    } else {
-      memcpy(result.data(), &m_audio[s0], n_samples * sizeof(float));
+    // the callback does not wait for us - if it wrapped around into the copied
+    // range while we were copying, drop the overwritten oldest samples
+    const size_t n_lost = std::min(n_overwritten(v), result.size());
+    if (n_lost > 0) {
+      result.erase(result.begin(), result.begin() + n_lost);
     }
   }
   if (return_silence) {
     int total_silence_ms = get_total_silence_ms();
-    m_total_skipped_ms = 0;
     // fprintf(stdout, "tmp: %d\n", total_silence_ms);
     return total_silence_ms;
   }
@@ -385,6 +651,56 @@ int audio_async::get(int ms, std::vector<float>& result, bool return_silence) {
   // print_energy();
 }
 
+audio_view audio_async::view(int ms) const {
+  if (ms <= 0) {
+    ms = m_len_ms;
+  }
+
+  // the acquire load makes all samples up to head visible
+  const size_t head = m_audio_head.load(std::memory_order_acquire);
+
+  return view_samples(head, (m_sample_rate * ms) / 1000);
+}
+
+audio_view audio_async::view_since(size_t seq) const {
+  const size_t head = m_audio_head.load(std::memory_order_acquire);
+
+  return view_samples(head, head - seq);
+}
+
+audio_view audio_async::view_samples(size_t head, size_t n_samples) const {
+  audio_view result;
+  result.seq = head;
+
+  if (!m_running) {
+    return result;
+  }
+
+  const size_t tail = m_audio_tail.load(std::memory_order_relaxed);
+
+  n_samples = std::min(n_samples, std::min(head - tail, m_audio_window));
+
+  const size_t s0 = (head - n_samples) & m_audio_mask;
+  const size_t n0 = std::min(n_samples, m_audio.size() - s0);
+
+  result.data[0] = &m_audio[s0];
+  result.n[0] = n0;
+  result.data[1] = &m_audio[0];
+  result.n[1] = n_samples - n0;
+
+  return result;
+}
+
+size_t audio_async::n_overwritten(const audio_view& view) const {
+  // order the reads of the samples before the load of the head
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  const size_t head = m_audio_head.load(std::memory_order_relaxed);
+  const size_t begin = view.seq - view.size();
+
+  return head - begin > m_audio.size() ? head - begin - m_audio.size() : 0;
+}
+
 bool sdl_poll_events() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
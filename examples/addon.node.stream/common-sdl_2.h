@@ -4,10 +4,45 @@
 #include <SDL_audio.h>
 
 #include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <mutex>
 #include <vector>
 
+#if defined(_WIN32)
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
+#include "audio_view.h"
+
+// counting semaphore whose post() never blocks, so the SDL audio thread can
+// wake a reader without taking a lock
+class audio_semaphore {
+ public:
+  audio_semaphore();
+  ~audio_semaphore();
+
+  audio_semaphore(const audio_semaphore&) = delete;
+  audio_semaphore& operator=(const audio_semaphore&) = delete;
+
+  void post();
+  void wait();
+  // returns false if the deadline passed without a post
+  bool wait_until(std::chrono::steady_clock::time_point deadline);
+
+ private:
+#if defined(_WIN32)
+  void* m_handle = nullptr;
+#elif defined(__APPLE__)
+  dispatch_semaphore_t m_sem;
+#else
+  sem_t m_sem;
+#endif
+};
+
 //
 // SDL Audio capture
 //
@@ -20,11 +55,22 @@ class audio_async {
 
   bool init(int capture_id, int sample_rate);
 
+  // no capture device - the samples are written by the caller with push()
+  bool init_push(int sample_rate);
+
+  // append samples when initialized with init_push(), returns the number of
+  // samples written - the caller is the only writer, like the SDL callback
+  size_t push(const float* samples, size_t n_samples);
+  size_t push(const int16_t* samples, size_t n_samples);
+
   // start capturing audio via the provided SDL callback
   // keep last len_ms seconds of audio in a circular buffer
+  // the SDL audio thread is the only writer and never waits for the reader
   bool resume();
   bool pause();
   bool clear();
+  // drop the samples up to the end of the view, keep the ones captured after it
+  bool clear(const audio_view& view);
 
   // callback to be called by SDL
   void callback(uint8_t* stream, int len);
@@ -35,23 +81,66 @@ class audio_async {
   // get audio data from the circular buffer
   int get(int ms, std::vector<float>& audio, bool return_silence = false);
 
+  // view the last ms of audio in the circular buffer without copying
+  // the callback keeps writing behind the view - check valid() after reading
+  // the samples, the ring leaves about one second before they are overwritten
+  audio_view view(int ms) const;
+  // view the audio captured after seq
+  audio_view view_since(size_t seq) const;
+  // number of samples at the start of the view the callback has overwritten
+  size_t n_overwritten(const audio_view& view) const;
+  bool valid(const audio_view& view) const { return n_overwritten(view) == 0; }
+
+  // number of samples captured so far (the seq of a view of the newest audio)
+  size_t seq() const { return m_audio_head.load(std::memory_order_acquire); }
+
+  // block until ms of audio have been captured after seq, the deadline passes
+  // or the capture is paused - returns true if the audio is available
+  bool wait(size_t seq, int ms, std::chrono::steady_clock::time_point deadline);
+
  private:
+  void init_ring(int sample_rate);
+
+  // append samples to the ring and publish them to the reader
+  void write(const float* samples, size_t n_samples);
+  void write_fill(float value, size_t n_samples);
+  // wake wait() if the head reached its target
+  void notify(size_t head);
+  // view the last n_samples before head
+  audio_view view_samples(size_t head, size_t n_samples) const;
+
   SDL_AudioDeviceID m_dev_id_in = 0;
+  bool m_push = false;
 
   int m_len_ms = 0;
   int m_sample_rate = 0;
   float m_silence_th = 0;
-  int m_total_skipped_ms = 0;
-  
+  // silence skipped by callback_ignore_silence, taken by get_total_silence_ms
+  std::atomic<int> m_total_skipped_ms{0};
+
+  // written by the SDL callback only
   int m_current_silence_ms = 0;
+  bool m_is_filled = false;
 
   std::atomic_bool m_running;
-  std::mutex m_mutex;
 
+  // single-producer / single-consumer ring, the size is a power of two
+  // m_audio_head counts the samples written so far (written by the callback only)
+  // m_audio_tail is the head at the last clear() (written by the reader only)
+  // the ring is one second larger than len_ms, so the callback can keep writing
+  // while the reader looks at the last len_ms without overwriting them
   std::vector<float> m_audio;
-  size_t m_audio_pos = 0;
-  size_t m_audio_len = 0;
-  bool m_is_filled = false;
+  size_t m_audio_mask = 0;
+  size_t m_audio_window = 0;
+  std::atomic<size_t> m_audio_head{0};
+  std::atomic<size_t> m_audio_tail{0};
+
+  // wait() arms the flag and sleeps on the semaphore until the deadline
+  // whoever clears the armed flag - the callback once the target is reached,
+  // pause() or the reader itself - owns the single post of that wait
+  audio_semaphore m_wait_sem;
+  std::atomic_bool m_wait_armed{false};
+  std::atomic<size_t> m_wait_target{0};
 };
 
 // Return false if need to quit
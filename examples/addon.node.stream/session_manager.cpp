@@ -0,0 +1,126 @@
+#include "session_manager.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+
+// same waits as the server - the first session of an idle batch waits this long for the others
+static const int k_encoder_batch_wait_ms = 10;
+static const int k_decoder_batch_wait_ms = 2;
+
+stream_model::~stream_model() {
+  if (m_encoder_batch) {
+    whisper_encoder_batch_free(m_encoder_batch);
+  }
+  if (m_decoder_batch) {
+    whisper_decoder_batch_free(m_decoder_batch);
+  }
+  if (m_ctx) {
+    whisper_free(m_ctx);
+  }
+}
+
+stream_model::turn::turn(stream_model& model) : m_model(model) {
+  std::unique_lock<std::mutex> lock(m_model.m_mutex);
+
+  const size_t ticket = m_model.m_ticket_next++;
+  m_model.m_cv.wait(lock, [&]() {
+    return ticket == m_model.m_ticket_head &&
+           m_model.m_n_running < m_model.m_n_parallel;
+  });
+
+  m_model.m_ticket_head++;
+  m_model.m_n_running++;
+
+  lock.unlock();
+
+  // the next ticket may fit in a free slot as well
+  m_model.m_cv.notify_all();
+}
+
+stream_model::turn::~turn() {
+  {
+    std::lock_guard<std::mutex> lock(m_model.m_mutex);
+    m_model.m_n_running--;
+  }
+
+  m_model.m_cv.notify_all();
+}
+
+// sessions that ask for a model while another one loads it wait for that load
+struct stream_model_entry {
+  std::weak_ptr<stream_model> model;
+  bool loading = false;
+};
+
+std::shared_ptr<stream_model> stream_model_acquire(const whisper_params& params) {
+  static std::mutex registry_mutex;
+  static std::condition_variable registry_cv;
+  static std::map<std::string, stream_model_entry> registry;
+
+  const std::string key = params.model + (params.use_gpu ? "#gpu" : "#cpu");
+
+  std::unique_lock<std::mutex> lock(registry_mutex);
+
+  // take the loaded model, or claim its load - a racing load of the same file
+  // is waited for instead of loading the file twice
+  while (true) {
+    stream_model_entry& entry = registry[key];
+
+    std::shared_ptr<stream_model> model = entry.model.lock();
+    if (model) {
+      return model;
+    }
+
+    if (!entry.loading) {
+      entry.loading = true;
+      break;
+    }
+
+    registry_cv.wait(lock);
+  }
+
+  // the load can take seconds, the sessions on other models go on meanwhile
+  lock.unlock();
+
+  std::shared_ptr<stream_model> model;
+
+  whisper_context_params cparams = whisper_context_default_params();
+  cparams.use_gpu = params.use_gpu;
+
+  whisper_context* ctx =
+      whisper_init_from_file_with_params_no_state(params.model.c_str(), cparams);
+  if (ctx == nullptr) {
+    fprintf(stderr, "%s: failed to load model '%s'\n", __func__,
+            params.model.c_str());
+  } else {
+    model.reset(new stream_model());
+    model->m_ctx = ctx;
+    model->m_n_parallel = std::max(1, params.n_parallel);
+
+    if (model->m_n_parallel > 1) {
+      model->m_encoder_batch = whisper_encoder_batch_init(
+          ctx, model->m_n_parallel, k_encoder_batch_wait_ms);
+      model->m_decoder_batch = whisper_decoder_batch_init(
+          ctx, model->m_n_parallel, k_decoder_batch_wait_ms);
+    }
+  }
+
+  lock.lock();
+
+  // the sessions waiting for a failed load try it themselves
+  if (model) {
+    stream_model_entry& entry = registry[key];
+    entry.model = model;
+    entry.loading = false;
+  } else {
+    registry.erase(key);
+  }
+
+  lock.unlock();
+
+  registry_cv.notify_all();
+
+  return model;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+#include "utils.h"
+#include "whisper.h"
+
+//
+// Streaming sessions sharing one loaded model
+//
+// The weights of a model file are loaded once, without a state, and every
+// session allocates only its own whisper_state. The sessions on a model take
+// turns to run inference in the order they asked for it, so at most n_parallel
+// whisper_full() calls compete for the CPU and a busy session cannot starve
+// the others.
+//
+
+class stream_model {
+ public:
+  ~stream_model();
+
+  whisper_context* ctx() const { return m_ctx; }
+
+  // encoder / decoder batches shared by the sessions, nullptr if n_parallel is 1
+  whisper_encoder_batch* encoder_batch() const { return m_encoder_batch; }
+  whisper_decoder_batch* decoder_batch() const { return m_decoder_batch; }
+
+  // a slot to run inference in, held for the duration of one whisper_full()
+  class turn {
+   public:
+    explicit turn(stream_model& model);
+    ~turn();
+
+    turn(const turn&) = delete;
+    turn& operator=(const turn&) = delete;
+
+   private:
+    stream_model& m_model;
+  };
+
+ private:
+  friend std::shared_ptr<stream_model> stream_model_acquire(
+      const whisper_params& params);
+
+  stream_model() = default;
+
+  whisper_context* m_ctx = nullptr;
+  whisper_encoder_batch* m_encoder_batch = nullptr;
+  whisper_decoder_batch* m_decoder_batch = nullptr;
+
+  // FIFO gate - tickets are handed out in arrival order and enter in the same order
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  size_t m_n_parallel = 1;
+  size_t m_n_running = 0;
+  size_t m_ticket_next = 0;
+  size_t m_ticket_head = 0;
+};
+
+// returns the model of params.model, loading it if no session holds it yet,
+// nullptr if it cannot be loaded. The model is freed with its last session.
+// n_parallel is taken from the session that loads the model
+std::shared_ptr<stream_model> stream_model_acquire(const whisper_params& params);
@@ -1,5 +1,6 @@
 #include "utils.h"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cmath>
@@ -166,6 +167,31 @@ void update_prompt_tokens(whisper_context* ctx,
     }
 }
 
+int adaptive_audio_ctx(int n_samples, int n_audio_ctx, bool speed_up)
+{
+    // one encoder position covers 2 mel frames of 10 ms
+    const int n_samples_per_ctx = 2 * WHISPER_SAMPLE_RATE / 100;
+
+    // buckets of 2.56 s - the allocator plan measured for the full context fits all of them,
+    // and concurrent sessions in the same bucket are batched through the encoder together
+    const int bucket = 128;
+
+    // very short contexts make the decoder hallucinate and loop, and speech that runs up to the
+    // end of the window loses its last words - keep a minimum and some trailing silence
+    const int min_ctx = 256;
+    const int margin = 32;
+
+    int n_ctx = (n_samples + n_samples_per_ctx - 1) / n_samples_per_ctx;
+    if (speed_up) {
+        // the phase vocoder halves the frames
+        n_ctx = (n_ctx + 1) / 2;
+    }
+
+    n_ctx = std::max(min_ctx, ((n_ctx + margin + bucket - 1) / bucket) * bucket);
+
+    return n_ctx < n_audio_ctx ? n_ctx : 0;
+}
+
 bool save_to_wav(const std::string& filename,
     const std::vector<float>& audio_data, int sample_rate)
 {
@@ -229,14 +255,17 @@ bool save_to_wav(const std::string& filename,
 }
 
 // Функция для вычисления ZCR в пределах окна
-float calculate_zcr(const std::vector<float>& pcmf32, int start,
+float calculate_zcr(const audio_view& pcmf32, int start,
     int window_samples)
 {
     int zcr_count = 0;
+    bool prev_neg = pcmf32[start] < 0;
     for (int i = start + 1; i < start + window_samples; ++i) {
-        if ((pcmf32[i - 1] < 0 && pcmf32[i] >= 0) || (pcmf32[i - 1] >= 0 && pcmf32[i] < 0)) {
+        const bool neg = pcmf32[i] < 0;
+        if (neg != prev_neg) {
             zcr_count++;
         }
+        prev_neg = neg;
     }
     return static_cast<float>(zcr_count) / window_samples;
 }
@@ -272,6 +301,16 @@ bool vad_detection_windowed_zcr(
     int window_ms,
     float zcr_threshold,
     bool verbose)
+{
+    return vad_detection_windowed_zcr(audio_view(pcmf32), sample_rate, window_ms, zcr_threshold, verbose);
+}
+
+bool vad_detection_windowed_zcr(
+    const audio_view& pcmf32,
+    int sample_rate,
+    int window_ms,
+    float zcr_threshold,
+    bool verbose)
 {
     // Рассчитаем количество образцов на окно
     int window_samples = (sample_rate * window_ms) / 1000;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "audio_view.h"
 #include "whisper.h"
 // #include "params.h"
 
@@ -18,6 +19,8 @@ struct whisper_params {
   int32_t capture_id = -1;
   int32_t max_tokens = 32;
   int32_t audio_ctx = 0;
+  int32_t queue_depth = 4;
+  int32_t n_parallel = 1;
 
   float vad_thold = 0.6f;
   float freq_thold = 100.0f;
@@ -31,10 +34,12 @@ struct whisper_params {
   bool tinydiarize = false;
   bool save_audio = false;
   bool use_gpu = true;
+  bool adaptive_audio_ctx = true;
 
   std::string language = "en";
   std::string model = "models/ggml-base.en.bin";
   std::string fname_out;
+  std::string drop_policy = "oldest";
 };
 
 struct whisper_context* init_whisper_context(const whisper_params& params,
@@ -51,6 +56,10 @@ void print_whisper_result(
 void update_prompt_tokens(whisper_context* ctx,
                           std::vector<whisper_token>& prompt_tokens,
                           bool no_context);
+// encoder context for an utterance of n_samples - the frames it spans plus a
+// margin, rounded up to a bucket. Returns 0 (the full context of the model)
+// when the utterance is too long for a reduced context to pay off
+int adaptive_audio_ctx(int n_samples, int n_audio_ctx, bool speed_up);
 void log_debug(const char* func, float energy_all, float energy_last,
                float vad_thold, float freq_thold);
 
@@ -58,5 +67,8 @@ bool save_to_wav(const std::string& filename,
                  const std::vector<float>& audio_data, int sample_rate);
 
 bool vad_detection_windowed_zcr(const std::vector<float>& pcmf32,
+                                int sample_rate, int window_ms,
+                                float zcr_threshold, bool verbose);
+bool vad_detection_windowed_zcr(const audio_view& pcmf32,
                                 int sample_rate, int window_ms,
                                 float zcr_threshold, bool verbose);
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "utterance_queue.h"
+
+#include <algorithm>
+
+bool utterance_drop_policy_from_str(const std::string& str,
+                                    utterance_drop_policy& policy) {
+  if (str == "oldest") {
+    policy = utterance_drop_policy::DROP_OLDEST;
+  } else if (str == "newest") {
+    policy = utterance_drop_policy::DROP_NEWEST;
+  } else if (str == "block") {
+    policy = utterance_drop_policy::BLOCK;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+utterance_queue::utterance_queue(size_t max_size, utterance_drop_policy policy)
+    : m_max_size(std::max<size_t>(1, max_size)), m_policy(policy) {}
+
+bool utterance_queue::push(utterance&& item) {
+  bool dropped = false;
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_policy == utterance_drop_policy::BLOCK) {
+      m_cv_push.wait(lock, [&]() {
+        return m_closed || m_items.size() < m_max_size;
+      });
+    }
+
+    if (m_closed) {
+      return false;
+    }
+
+    if (m_items.size() >= m_max_size) {
+      m_n_dropped++;
+      dropped = true;
+
+      if (m_policy == utterance_drop_policy::DROP_NEWEST) {
+        return false;
+      }
+
+      m_items.pop_front();
+    }
+
+    m_items.push_back(std::move(item));
+  }
+
+  m_cv_pop.notify_one();
+
+  return !dropped;
+}
+
+bool utterance_queue::pop(utterance& item) {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    m_cv_pop.wait(lock, [&]() { return m_closed || !m_items.empty(); });
+
+    if (m_items.empty()) {
+      return false;
+    }
+
+    item = std::move(m_items.front());
+    m_items.pop_front();
+  }
+
+  m_cv_push.notify_one();
+
+  return true;
+}
+
+void utterance_queue::close() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+  }
+
+  m_cv_push.notify_all();
+  m_cv_pop.notify_all();
+}
+
+size_t utterance_queue::size() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_items.size();
+}
+
+size_t utterance_queue::n_dropped() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_n_dropped;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//
+// Bounded queue between the segmenter and the inference thread
+//
+
+// audio cut by the segmenter, ready to be transcribed
+struct utterance {
+  std::vector<float> pcmf32;
+
+  // capture position of the last sample
+  size_t seq = 0;
+  // step mode - number of samples at the end of pcmf32 that are new in this step
+  int n_new = 0;
+  // ms since the previous utterance was cut
+  int time_since_last = 0;
+};
+
+// what push() does when the queue is full
+enum class utterance_drop_policy {
+  DROP_OLDEST,  // drop the oldest queued utterance
+  DROP_NEWEST,  // drop the utterance being pushed
+  BLOCK,        // wait until the inference thread pops one
+};
+
+// parse "oldest", "newest" or "block", returns false for anything else
+bool utterance_drop_policy_from_str(const std::string& str,
+                                    utterance_drop_policy& policy);
+
+class utterance_queue {
+ public:
+  utterance_queue(size_t max_size, utterance_drop_policy policy);
+
+  // returns false if an utterance was dropped - the pushed one, or the
+  // oldest queued one - or if the queue is closed
+  bool push(utterance&& item);
+
+  // block until an utterance is available, returns false once the queue is
+  // closed and empty
+  bool pop(utterance& item);
+
+  // wake up everyone, push() fails from now on
+  void close();
+
+  size_t size() const;
+  size_t n_dropped() const;
+
+ private:
+  const size_t m_max_size;
+  const utterance_drop_policy m_policy;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cv_push;
+  std::condition_variable m_cv_pop;
+
+  std::deque<utterance> m_items;
+  size_t m_n_dropped = 0;
+  bool m_closed = false;
+};
@@ -0,0 +1,101 @@
+#include "vad.h"
+
+#include <algorithm>
+#include <cmath>
+
+audio_vad::audio_vad(int sample_rate, int len_ms, float freq_thold,
+                     int zcr_window_ms) {
+  m_sample_rate = sample_rate;
+
+  m_filter = freq_thold > 0.0f;
+  if (m_filter) {
+    const float rc = 1.0f / (2.0f * M_PI * freq_thold);
+    const float dt = 1.0f / sample_rate;
+    m_alpha = dt / (rc + dt);
+  }
+
+  m_energy_cum.resize((size_t)sample_rate * len_ms / 1000 + 1, 0.0);
+  m_zcr_window = std::max<size_t>(1, (size_t)sample_rate * zcr_window_ms / 1000);
+}
+
+void audio_vad::push(const float* samples, size_t n_samples) {
+  const size_t n_cum = m_energy_cum.size();
+
+  for (size_t i = 0; i < n_samples; ++i) {
+    const float x = samples[i];
+
+    if (m_n_pushed == 0) {
+      m_x_prev = x;
+      m_y = x;
+    }
+
+    const float y = m_filter && m_n_pushed > 0 ? m_alpha * (m_y + x - m_x_prev) : x;
+
+    if ((x < 0) != (m_x_prev < 0)) {
+      m_zcr_count++;
+    }
+
+    m_x_prev = x;
+    m_y = y;
+
+    m_energy_sum += std::fabs(y);
+    m_n_pushed++;
+    m_energy_cum[m_n_pushed % n_cum] = m_energy_sum;
+
+    if (++m_zcr_n == m_zcr_window) {
+      m_zcr_max = std::max(m_zcr_max, (float)m_zcr_count / m_zcr_window);
+      m_zcr_n = 0;
+      m_zcr_count = 0;
+    }
+  }
+}
+
+void audio_vad::push(const audio_view& samples) {
+  push(samples.data[0], samples.n[0]);
+  push(samples.data[1], samples.n[1]);
+}
+
+void audio_vad::reset_utterance() {
+  m_zcr_n = 0;
+  m_zcr_count = 0;
+  m_zcr_max = 0.0f;
+  m_fading = false;
+}
+
+size_t audio_vad::n_samples(int ms) const {
+  const size_t n = (size_t)m_sample_rate * std::max(0, ms) / 1000;
+  return std::min(n, std::min(m_n_pushed, m_energy_cum.size() - 1));
+}
+
+float audio_vad::energy(int ms) const {
+  const size_t n = n_samples(ms);
+  if (n == 0) {
+    return 0.0f;
+  }
+
+  const size_t n_cum = m_energy_cum.size();
+  const double sum = m_energy_cum[m_n_pushed % n_cum] -
+                     m_energy_cum[(m_n_pushed - n) % n_cum];
+
+  return (float)(sum / n);
+}
+
+bool audio_vad::fade_out(int all_ms, int last_ms, float vad_thold,
+                         int hangover_ms) {
+  // not enough samples - assume no speech
+  const bool faded = n_samples(last_ms) < n_samples(all_ms) &&
+                     n_samples(last_ms) > 0 &&
+                     energy(last_ms) <= vad_thold * energy(all_ms);
+
+  if (!faded) {
+    m_fading = false;
+    return false;
+  }
+
+  if (!m_fading) {
+    m_fading = true;
+    m_fade_start = m_n_pushed;
+  }
+
+  return m_n_pushed - m_fade_start >= (size_t)m_sample_rate * hangover_ms / 1000;
+}
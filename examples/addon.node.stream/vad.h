@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "audio_view.h"
+
+//
+// Incremental voice activity detection
+//
+// Every captured sample is pushed once. A running high-pass filter, prefix
+// sums of the filtered energy and fixed zero crossing windows keep the cost of
+// push() proportional to the new samples, the decisions are O(1).
+//
+
+class audio_vad {
+ public:
+  // len_ms - the longest window the energy can be measured over
+  // freq_thold - high-pass filter cutoff, 0 to disable
+  // zcr_window_ms - the zero crossing rate is measured in windows of this size
+  audio_vad(int sample_rate, int len_ms, float freq_thold, int zcr_window_ms);
+
+  void push(const float* samples, size_t n_samples);
+  void push(const audio_view& samples);
+
+  // start a new utterance - resets the zero crossing windows and the hangover
+  void reset_utterance();
+
+  // mean absolute amplitude of the high-passed signal over the last ms
+  float energy(int ms) const;
+
+  // the speech faded out: the energy of the last last_ms is at most vad_thold
+  // times the energy of the last all_ms, and has been for hangover_ms
+  bool fade_out(int all_ms, int last_ms, float vad_thold, int hangover_ms = 0);
+
+  // highest zero crossing rate of a full window since reset_utterance()
+  float zcr_max() const { return m_zcr_max; }
+
+  // number of samples pushed so far
+  size_t n_pushed() const { return m_n_pushed; }
+
+ private:
+  size_t n_samples(int ms) const;
+
+  int m_sample_rate = 0;
+
+  // high-pass filter state, same filter as high_pass_filter()
+  bool m_filter = false;
+  float m_alpha = 0.0f;
+  float m_x_prev = 0.0f;
+  float m_y = 0.0f;
+
+  // m_energy_cum[i % size] is the sum of |y| over the first i samples
+  std::vector<double> m_energy_cum;
+  double m_energy_sum = 0.0;
+  size_t m_n_pushed = 0;
+
+  // zero crossings of the raw signal in the current window
+  size_t m_zcr_window = 0;
+  size_t m_zcr_n = 0;
+  size_t m_zcr_count = 0;
+  float m_zcr_max = 0.0f;
+
+  // sample at which the fade out condition started to hold
+  size_t m_fade_start = 0;
+  bool m_fading = false;
+};
@@ -1,14 +1,17 @@
 #include "whisper.h"
 
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <string>
 #include <thread>
+#include <vector>
 
 // command-line parameters
 struct whisper_params {
     int32_t n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
-    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat
+    int32_t what = 0; // what to benchmark: 0 - whisper encoder, 1 - memcpy, 2 - ggml_mul_mat, 3 - mel spectrogram
 
     std::string model = "models/ggml-base.en.bin";
 
@@ -52,6 +55,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "                           %-7s  0 - whisper\n",                                 "");
     fprintf(stderr, "                           %-7s  1 - memcpy\n",                                  "");
     fprintf(stderr, "                           %-7s  2 - ggml_mul_mat\n",                            "");
+    fprintf(stderr, "                           %-7s  3 - mel spectrogram\n",                         "");
     fprintf(stderr, "\n");
 }
 
@@ -150,6 +154,60 @@ int whisper_bench_full(const whisper_params & params) {
     return 0;
 }
 
+// time whisper_pcm_to_mel() on 10 minutes of synthetic audio for 1 .. n_threads threads
+int whisper_bench_mel(const whisper_params & params) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = params.use_gpu;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+
+    {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n", params.n_threads, std::thread::hardware_concurrency(), whisper_print_system_info());
+    }
+
+    if (ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return 2;
+    }
+
+    const int n_samples = 10*60*WHISPER_SAMPLE_RATE;
+    const int n_iter    = 4;
+
+    std::vector<float> pcmf32(n_samples);
+    for (int i = 0; i < n_samples; i++) {
+        pcmf32[i] = 0.5f*sinf(2.0f*3.14159265f*440.0f*i/WHISPER_SAMPLE_RATE) + 0.1f*sinf(0.37f*i);
+    }
+
+    // heat
+    if (int ret = whisper_pcm_to_mel(ctx, pcmf32.data(), n_samples, params.n_threads) != 0) {
+        fprintf(stderr, "error: failed to compute mel: %d\n", ret);
+        return 4;
+    }
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: audio = %.1f s, %d iterations\n", __func__, float(n_samples)/WHISPER_SAMPLE_RATE, n_iter);
+
+    for (int n_threads = 1; n_threads <= params.n_threads; n_threads++) {
+        const auto t_start = std::chrono::high_resolution_clock::now();
+
+        for (int i = 0; i < n_iter; i++) {
+            if (int ret = whisper_pcm_to_mel(ctx, pcmf32.data(), n_samples, n_threads) != 0) {
+                fprintf(stderr, "error: failed to compute mel: %d\n", ret);
+                return 4;
+            }
+        }
+
+        const double t_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count()/n_iter;
+
+        fprintf(stderr, "%s: n_threads = %2d | %8.2f ms\n", __func__, n_threads, t_ms);
+    }
+
+    whisper_free(ctx);
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     whisper_params params;
 
@@ -163,6 +221,7 @@ int main(int argc, char ** argv) {
         case 0: ret = whisper_bench_full(params);                break;
         case 1: ret = whisper_bench_memcpy(params.n_threads);       break;
         case 2: ret = whisper_bench_ggml_mul_mat(params.n_threads); break;
+        case 3: ret = whisper_bench_mel(params);                  break;
         default: fprintf(stderr, "error: unknown benchmark: %d\n", params.what); break;
     }
 
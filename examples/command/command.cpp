@@ -266,39 +266,27 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
 
     int max_len = 0;
 
-    std::vector<std::vector<whisper_token>> allowed_tokens;
-
-    for (const auto & cmd : allowed_commands) {
-        whisper_token tokens[1024];
-        allowed_tokens.emplace_back();
-
-        for (int l = 0; l < (int) cmd.size(); ++l) {
-            // NOTE: very important to add the whitespace !
-            //       the reason is that the first decoded token starts with a whitespace too!
-            std::string ss = std::string(" ") + cmd.substr(0, l + 1);
-
-            const int n = whisper_tokenize(ctx, ss.c_str(), tokens, 1024);
-            if (n < 0) {
-                fprintf(stderr, "%s: error: failed to tokenize command '%s'\n", __func__, cmd.c_str());
-                return 3;
-            }
+    // compile the commands into a token trie that constrains the decoding
+    whisper_phrases * phrases = nullptr;
+    {
+        std::vector<const char *> cmds;
+        for (const auto & cmd : allowed_commands) {
+            cmds.push_back(cmd.c_str());
 
-            if (n == 1) {
-                allowed_tokens.back().push_back(tokens[0]);
-            }
+            max_len = std::max(max_len, (int) cmd.size());
         }
 
-        max_len = std::max(max_len, (int) cmd.size());
+        phrases = whisper_phrases_init(ctx, cmds.data(), cmds.size());
+        if (phrases == nullptr) {
+            fprintf(stderr, "%s: error: failed to tokenize the commands\n", __func__);
+            return 3;
+        }
     }
 
-    fprintf(stderr, "%s: allowed commands [ tokens ]:\n", __func__);
+    fprintf(stderr, "%s: allowed commands:\n", __func__);
     fprintf(stderr, "\n");
     for (int i = 0; i < (int) allowed_commands.size(); ++i) {
-        fprintf(stderr, "  - \033[1m%-*s\033[0m = [", max_len, allowed_commands[i].c_str());
-        for (const auto & token : allowed_tokens[i]) {
-            fprintf(stderr, " %5d", token);
-        }
-        fprintf(stderr, " ]\n");
+        fprintf(stderr, "  - \033[1m%s\033[0m\n", allowed_commands[i].c_str());
     }
 
     std::string k_prompt = "select one from the available words: ";
@@ -317,6 +305,7 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
         const int n = whisper_tokenize(ctx, k_prompt.c_str(), k_tokens.data(), 1024);
         if (n < 0) {
             fprintf(stderr, "%s: error: failed to tokenize prompt '%s'\n", __func__, k_prompt.c_str());
+            whisper_phrases_free(phrases);
             return 4;
         }
         k_tokens.resize(n);
@@ -362,8 +351,8 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
             wparams.print_timestamps = !params.no_timestamps;
             wparams.translate        = params.translate;
             wparams.no_context       = true;
+            wparams.no_timestamps    = true;
             wparams.single_segment   = true;
-            wparams.max_tokens       = 1;
             wparams.language         = params.language.c_str();
             wparams.n_threads        = params.n_threads;
 
@@ -373,84 +362,46 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
             wparams.prompt_tokens    = k_tokens.data();
             wparams.prompt_n_tokens  = k_tokens.size();
 
-            // run the transformer and a single decoding pass
+            // the decoded text can only be one of the commands
+            wparams.phrases          = phrases;
+
             if (whisper_full(ctx, wparams, pcmf32_cur.data(), pcmf32_cur.size()) != 0) {
                 fprintf(stderr, "%s: ERROR: whisper_full() failed\n", __func__);
                 break;
             }
 
-            // estimate command probability
-            // NOTE: not optimal
-            {
-                const auto * logits = whisper_get_logits(ctx);
+            if (whisper_full_n_segments(ctx) > 0) {
+                std::vector<whisper_token> tokens;
 
-                std::vector<float> probs(whisper_n_vocab(ctx), 0.0f);
-
-                // compute probs from logits via softmax
-                {
-                    float max = -1e9;
-                    for (int i = 0; i < (int) probs.size(); ++i) {
-                        max = std::max(max, logits[i]);
-                    }
+                // probability of the command among the commands, the product of its token probabilities
+                float prob = 1.0f;
 
-                    float sum = 0.0f;
-                    for (int i = 0; i < (int) probs.size(); ++i) {
-                        probs[i] = expf(logits[i] - max);
-                        sum += probs[i];
+                fprintf(stdout, "\n");
+                fprintf(stdout, "%s: tokens:", __func__);
+                for (int i = 0; i < whisper_full_n_tokens(ctx, 0); ++i) {
+                    const whisper_token id = whisper_full_get_token_id(ctx, 0, i);
+                    if (id >= whisper_token_eot(ctx)) {
+                        continue;
                     }
 
-                    for (int i = 0; i < (int) probs.size(); ++i) {
-                        probs[i] /= sum;
-                    }
-                }
+                    const float p = whisper_full_get_token_p(ctx, 0, i);
 
-                std::vector<std::pair<float, int>> probs_id;
+                    tokens.push_back(id);
+                    prob *= p;
 
-                double psum = 0.0;
-                for (int i = 0; i < (int) allowed_commands.size(); ++i) {
-                    probs_id.emplace_back(probs[allowed_tokens[i][0]], i);
-                    for (int j = 1; j < (int) allowed_tokens[i].size(); ++j) {
-                        probs_id.back().first += probs[allowed_tokens[i][j]];
-                    }
-                    probs_id.back().first /= allowed_tokens[i].size();
-                    psum += probs_id.back().first;
+                    fprintf(stdout, " '%s' %f", whisper_token_to_str(ctx, id), p);
                 }
+                fprintf(stdout, "\n");
 
-                // normalize
-                for (auto & p : probs_id) {
-                    p.first /= psum;
-                }
-
-                // sort descending
-                {
-                    using pair_type = decltype(probs_id)::value_type;
-                    std::sort(probs_id.begin(), probs_id.end(), [](const pair_type & a, const pair_type & b) {
-                        return a.first > b.first;
-                    });
-                }
-
-                // print the commands and the respective probabilities
-                {
-                    fprintf(stdout, "\n");
-                    for (const auto & cmd : probs_id) {
-                        fprintf(stdout, "%s: %s%-*s%s = %f | ", __func__, "\033[1m", max_len, allowed_commands[cmd.second].c_str(), "\033[0m", cmd.first);
-                        for (int token : allowed_tokens[cmd.second]) {
-                            fprintf(stdout, "'%4s' %f ", whisper_token_to_str(ctx, token), probs[token]);
-                        }
-                        fprintf(stdout, "\n");
-                    }
-                }
+                const int index = whisper_phrases_match(phrases, tokens.data(), tokens.size());
 
                 // best command
-                {
+                if (index >= 0) {
                     const auto t_end = std::chrono::high_resolution_clock::now();
 
-                    const float prob = probs_id[0].first;
-                    const int index = probs_id[0].second;
-
                     fprintf(stdout, "\n");
-                    fprintf(stdout, "%s: detected command: %s%s%s | p = %f | t = %d ms\n", __func__,
-                            "\033[1m", allowed_commands[index].c_str(), "\033[0m", prob,
+                    fprintf(stdout, "%s: detected command: %s%-*s%s | p = %f | t = %d ms\n", __func__,
+                            "\033[1m", max_len, allowed_commands[index].c_str(), "\033[0m", prob,
                             (int) std::chrono::duration_cast<std::chrono::milliseconds>(t_end - t_start).count());
                     fprintf(stdout, "\n");
                 }
@@ -460,6 +411,8 @@ int process_command_list(struct whisper_context * ctx, audio_async &audio, const
         }
     }
 
+    whisper_phrases_free(phrases);
+
     return 0;
 }
 
@@ -1,5 +1,6 @@
 #include "common-ggml.h"
 
+#include <cstring>
 #include <regex>
 #include <map>
 
@@ -114,6 +115,10 @@ bool ggml_common_quantize_0(
         std::string name(length, 0);
         finp.read (&name[0], length);
 
+        // aligned model files pad the name with NUL bytes, the padding is not kept in the output
+        name.resize(strlen(name.c_str()));
+        length = name.size();
+
         printf("%64s - [%5d, %5d, %5d], type = %6s ", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype));
 
         bool quantize = false;
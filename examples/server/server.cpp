@@ -4,9 +4,13 @@
 #include "httplib.h"
 #include "json.hpp"
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <fstream>
+#include <memory>
 #include <cstdio>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -38,6 +42,12 @@ struct server_params
     int32_t port          = 8080;
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
+    int32_t n_parallel    = 1;
+    int32_t max_queue     = 16;
+    int32_t encoder_batch = 1;
+    int32_t encoder_wait  = 10;
+    int32_t decoder_batch = 1;
+    int32_t decoder_wait  = 2;
 
     bool ffmpeg_converter = false;
 };
@@ -75,6 +85,8 @@ struct whisper_params {
     bool print_progress  = false;
     bool no_timestamps   = false;
     bool use_gpu         = true;
+    bool use_mmap        = true;
+    bool use_mlock       = false;
 
     std::string language        = "en";
     std::string prompt          = "";
@@ -127,13 +139,21 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt\n",                                 params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
+    fprintf(stderr, "  -nmm,      --no-mmap           [%-7s] read the model file instead of mapping it\n",     params.use_mmap ? "false" : "true");
+    fprintf(stderr, "             --mlock             [%-7s] lock the mapped model in memory\n",               params.use_mlock ? "true" : "false");
     // server params
     fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps\n", params.dtw.c_str());
     fprintf(stderr, "  --host HOST,                   [%-7s] Hostname/ip-adress for the server\n", sparams.hostname.c_str());
     fprintf(stderr, "  --port PORT,                   [%-7d] Port number for the server\n", sparams.port);
     fprintf(stderr, "  --public PATH,                 [%-7s] Path to the public folder\n", sparams.public_path.c_str());
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
-    fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  -np N,     --parallel N        [%-7d] number of requests processed concurrently (one state each)\n", sparams.n_parallel);
+    fprintf(stderr, "  -mq N,     --max-queue N       [%-7d] max requests waiting for a free state (-1 - unlimited)\n", sparams.max_queue);
+    fprintf(stderr, "  -eb N,     --encoder-batch N   [%-7d] max concurrent requests encoded in one batch (1 - disabled)\n", sparams.encoder_batch);
+    fprintf(stderr, "  -ebw N,    --encoder-batch-wait N [%-4d] ms to wait for more requests before encoding a batch\n", sparams.encoder_wait);
+    fprintf(stderr, "  -db N,     --decoder-batch N   [%-7d] max concurrent requests decoded in one batch (1 - disabled)\n", sparams.decoder_batch);
+    fprintf(stderr, "  -dbw N,    --decoder-batch-wait N [%-4d] ms to wait for more requests before a decoding step\n", sparams.decoder_wait);
     fprintf(stderr, "\n");
 }
 
@@ -178,12 +198,20 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = argv[++i]; }
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = argv[++i]; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
+        else if (arg == "-nmm"  || arg == "--no-mmap")         { params.use_mmap        = false; }
+        else if (                  arg == "--mlock")           { params.use_mlock       = true; }
         // server params
         else if (                  arg == "--port")            { sparams.port        = std::stoi(argv[++i]); }
         else if (                  arg == "--host")            { sparams.hostname    = argv[++i]; }
         else if (                  arg == "--public")          { sparams.public_path = argv[++i]; }
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (arg == "-np"   || arg == "--parallel")        { sparams.n_parallel  = std::stoi(argv[++i]); }
+        else if (arg == "-mq"   || arg == "--max-queue")       { sparams.max_queue   = std::stoi(argv[++i]); }
+        else if (arg == "-eb"   || arg == "--encoder-batch")   { sparams.encoder_batch = std::stoi(argv[++i]); }
+        else if (arg == "-ebw"  || arg == "--encoder-batch-wait") { sparams.encoder_wait = std::stoi(argv[++i]); }
+        else if (arg == "-db"   || arg == "--decoder-batch")   { sparams.decoder_batch = std::stoi(argv[++i]); }
+        else if (arg == "-dbw"  || arg == "--decoder-batch-wait") { sparams.decoder_wait = std::stoi(argv[++i]); }
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             whisper_print_usage(argc, argv, params, sparams);
@@ -201,6 +229,171 @@ struct whisper_print_user_data {
     int progress_prev;
 };
 
+// the requests waiting for a free state, counted across all pools of the server
+// while /load switches models, requests can wait on the old and the new pool at the same time,
+// both are bounded by the same max_queue
+struct whisper_server_queue {
+    int32_t max_queue = -1;
+
+    std::atomic<int32_t> n_waiting = { 0 };
+};
+
+// reserves a place in the queue, returns false if it is full
+bool whisper_server_queue_enter(whisper_server_queue & queue) {
+    int32_t n_waiting = queue.n_waiting.load();
+    do {
+        if (queue.max_queue >= 0 && n_waiting >= queue.max_queue) {
+            return false;
+        }
+    } while (!queue.n_waiting.compare_exchange_weak(n_waiting, n_waiting + 1));
+
+    return true;
+}
+
+void whisper_server_queue_leave(whisper_server_queue & queue) {
+    queue.n_waiting--;
+}
+
+// a fixed set of whisper_state objects sharing the weights of one whisper_context
+// each request checks out a state for the duration of its inference, so up to
+// n_parallel requests run concurrently while the rest wait in a bounded queue
+struct whisper_state_pool {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<whisper_state *> states; // all states owned by the pool
+    std::vector<whisper_state *> avail;  // states that are not checked out
+
+    std::shared_ptr<whisper_server_queue> queue; // shared with the pools of the other models
+};
+
+bool whisper_state_pool_init(whisper_state_pool & pool, whisper_context * ctx, int n_states, const whisper_params & params) {
+    for (int i = 0; i < n_states; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "error: failed to initialize whisper state %d\n", i);
+            return false;
+        }
+
+        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
+        whisper_ctx_init_openvino_encoder_with_state(ctx, state, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+        pool.states.push_back(state);
+    }
+
+    pool.avail = pool.states;
+
+    return true;
+}
+
+void whisper_state_pool_free(whisper_state_pool & pool) {
+    for (auto * state : pool.states) {
+        whisper_free_state(state);
+    }
+
+    pool.states.clear();
+    pool.avail.clear();
+}
+
+// returns nullptr without waiting if the queue of pending requests is full
+whisper_state * whisper_state_pool_acquire(whisper_state_pool & pool) {
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    if (pool.avail.empty()) {
+        if (!whisper_server_queue_enter(*pool.queue)) {
+            return nullptr;
+        }
+
+        pool.cv.wait(lock, [&] { return !pool.avail.empty(); });
+        whisper_server_queue_leave(*pool.queue);
+    }
+
+    whisper_state * state = pool.avail.back();
+    pool.avail.pop_back();
+
+    return state;
+}
+
+void whisper_state_pool_release(whisper_state_pool & pool, whisper_state * state) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.avail.push_back(state);
+    }
+
+    pool.cv.notify_all();
+}
+
+// returns the checked out state to the pool when the request goes out of scope
+struct whisper_state_lease {
+    whisper_state_pool & pool;
+    whisper_state * state;
+
+    ~whisper_state_lease() {
+        whisper_state_pool_release(pool, state);
+    }
+};
+
+// a loaded model together with its pool of states and batches
+// every request holds a reference to the model it started on, so /load can switch new requests to
+// another model while the running ones finish on the old one, which is freed by the last of them
+struct whisper_server_model {
+    whisper_context * ctx = nullptr;
+
+    whisper_state_pool pool;
+
+    whisper_encoder_batch * encoder_batch = nullptr;
+    whisper_decoder_batch * decoder_batch = nullptr;
+
+    ~whisper_server_model() {
+        whisper_decoder_batch_free(decoder_batch);
+        whisper_encoder_batch_free(encoder_batch);
+        whisper_state_pool_free(pool);
+        whisper_free(ctx);
+    }
+};
+
+std::shared_ptr<whisper_server_model> whisper_server_model_load(
+        const std::string & path_model,
+        const whisper_context_params & cparams,
+        const whisper_params & params,
+        const server_params & sparams,
+        const std::shared_ptr<whisper_server_queue> & queue) {
+    auto model = std::make_shared<whisper_server_model>();
+
+    // the weights are loaded once and shared by all states in the pool
+    model->ctx = whisper_init_from_file_with_params_no_state(path_model.c_str(), cparams);
+    if (model->ctx == nullptr) {
+        fprintf(stderr, "error: failed to initialize whisper context\n");
+        return nullptr;
+    }
+
+    model->pool.queue = queue;
+
+    if (!whisper_state_pool_init(model->pool, model->ctx, sparams.n_parallel, params)) {
+        return nullptr;
+    }
+
+    // encoder windows of concurrent requests are evaluated together
+    if (sparams.encoder_batch > 1 && sparams.n_parallel > 1) {
+        model->encoder_batch = whisper_encoder_batch_init(model->ctx, std::min(sparams.encoder_batch, sparams.n_parallel), sparams.encoder_wait);
+        if (model->encoder_batch == nullptr) {
+            fprintf(stderr, "error: failed to initialize the batched encoder\n");
+            return nullptr;
+        }
+    }
+
+    // decoding steps of concurrent requests are evaluated together
+    if (sparams.decoder_batch > 1 && sparams.n_parallel > 1) {
+        model->decoder_batch = whisper_decoder_batch_init(model->ctx, std::min(sparams.decoder_batch, sparams.n_parallel), sparams.decoder_wait);
+        if (model->decoder_batch == nullptr) {
+            fprintf(stderr, "error: failed to initialize the batched decoder\n");
+            return nullptr;
+        }
+    }
+
+    return model;
+}
+
 void check_ffmpeg_availibility() {
     int result = system("ffmpeg -version");
 
@@ -282,11 +475,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -302,8 +495,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -315,29 +508,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -350,17 +543,17 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+std::string output_str(struct whisper_state * state, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -478,8 +671,6 @@ int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
-
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
         return 1;
@@ -497,12 +688,25 @@ int main(int argc, char ** argv) {
         exit(0);
     }
 
+    if (sparams.n_parallel < 1) {
+        fprintf(stderr, "error: --parallel must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
+    if (params.n_processors > 1) {
+        fprintf(stderr, "warning: --processors is not supported by the server, use --parallel to process several requests at once\n");
+        params.n_processors = 1;
+    }
+
     if (sparams.ffmpeg_converter) {
         check_ffmpeg_availibility();
     }
     // whisper init
     struct whisper_context_params cparams = whisper_context_default_params();
-    cparams.use_gpu = params.use_gpu;
+    cparams.use_gpu   = params.use_gpu;
+    cparams.use_mmap  = params.use_mmap;
+    cparams.use_mlock = params.use_mlock;
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
         cparams.dtw_aheads_preset = WHISPER_AHEADS_NONE;
@@ -547,15 +751,28 @@ int main(int argc, char ** argv) {
         }
     }
 
-    struct whisper_context * ctx = whisper_init_from_file_with_params(params.model.c_str(), cparams);
+    // the requests waiting for a state, shared by the current model and the ones replaced by /load
+    auto queue = std::make_shared<whisper_server_queue>();
+    queue->max_queue = sparams.max_queue;
 
-    if (ctx == nullptr) {
-        fprintf(stderr, "error: failed to initialize whisper context\n");
+    // the model used by new requests, replaced by /load
+    std::shared_ptr<whisper_server_model> model_cur = whisper_server_model_load(params.model, cparams, params, sparams, queue);
+    if (model_cur == nullptr) {
         return 3;
     }
 
-    // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-    whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+    std::mutex model_mutex;
+
+    auto model_get = [&]() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        return model_cur;
+    };
+
+    // serializes concurrent /load requests
+    std::mutex load_mutex;
+
+    // used to give concurrent requests distinct temporary files
+    std::atomic<int> n_requests(0);
 
     Server svr;
     svr.set_default_headers({{"Server", "whisper.cpp"},
@@ -646,8 +863,8 @@ int main(int argc, char ** argv) {
     });
 
     svr.Post(sparams.request_path + "/inference", [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // each request works on its own copy of the params
+        whisper_params params = default_params;
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -672,7 +889,7 @@ int main(int argc, char ** argv) {
         if (sparams.ffmpeg_converter) {
             // if file is not wav, convert to wav
             // write to temporary file
-            const std::string temp_filename = "whisper_server_temp_file.wav";
+            const std::string temp_filename = "whisper_server_temp_file_" + std::to_string(n_requests++) + ".wav";
             std::ofstream temp_file{temp_filename, std::ios::binary};
             temp_file << audio_file.content;
             temp_file.close();
@@ -708,6 +925,23 @@ int main(int argc, char ** argv) {
 
         printf("Successfully loaded %s\n", filename.c_str());
 
+        // the request keeps using this model even if /load replaces it in the meantime
+        const std::shared_ptr<whisper_server_model> model = model_get();
+
+        whisper_context * ctx = model->ctx;
+
+        // check out a state, waiting for one to become free if all of them are busy
+        whisper_state * state = whisper_state_pool_acquire(model->pool);
+        if (state == nullptr) {
+            fprintf(stderr, "error: too many pending requests\n");
+            const std::string error_resp = "{\"error\":\"server is busy, too many pending requests\"}";
+            res.set_content(error_resp, "application/json");
+            res.status = 503;
+            return;
+        }
+
+        whisper_state_lease lease = { model->pool, state };
+
         // print system information
         {
             fprintf(stderr, "\n");
@@ -770,6 +1004,9 @@ int main(int argc, char ** argv) {
 
             wparams.initial_prompt   = params.prompt.c_str();
 
+            wparams.encoder_batch    = model->encoder_batch;
+            wparams.decoder_batch    = model->decoder_batch;
+
             wparams.greedy.best_of        = params.best_of;
             wparams.beam_search.beam_size = params.beam_size;
 
@@ -819,7 +1056,7 @@ int main(int argc, char ** argv) {
                 wparams.abort_callback_user_data = &is_aborted;
             }
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            if (whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 const std::string error_resp = "{\"error\":\"failed to process audio\"}";
                 res.set_content(error_resp, "application/json");
@@ -830,17 +1067,17 @@ int main(int argc, char ** argv) {
         // return results to user
         if (params.response_format == text_format)
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             res.set_content(results.c_str(), "text/html");
         }
         else if (params.response_format == srt_format)
         {
             std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -858,11 +1095,11 @@ int main(int argc, char ** argv) {
 
             ss << "WEBVTT\n\n";
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -878,37 +1115,37 @@ int main(int argc, char ** argv) {
             res.set_content(ss.str(), "text/vtt");
         } else if (params.response_format == vjson_format) {
             /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             json jres = json{
                 {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
+                {"language", whisper_lang_str_full(whisper_full_lang_id_from_state(state))},
                 {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
                 {"text", results},
                 {"segments", json::array()}
             };
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
             for (int i = 0; i < n_segments; ++i)
             {
                 json segment = json{
                     {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
+                    {"text", whisper_full_get_segment_text_from_state(state, i)},
                 };
 
                 if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+                    segment["start"] = whisper_full_get_segment_t0_from_state(state, i) * 0.01;
+                    segment["end"] = whisper_full_get_segment_t1_from_state(state, i) * 0.01;
                 }
 
                 float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
+                const int n_tokens = whisper_full_n_tokens_from_state(state, i);
                 for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
+                    whisper_token_data token = whisper_full_get_token_data_from_state(state, i, j);
                     if (token.id >= whisper_token_eot(ctx)) {
                         continue;
                     }
 
                     segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
+                    json word = json{{"word", whisper_full_get_token_text_from_state(ctx, state, i, j)}};
                     if (!params.no_timestamps) {
                         word["start"] = token.t0 * 0.01;
                         word["end"] = token.t1 * 0.01;
@@ -934,19 +1171,15 @@ int main(int argc, char ** argv) {
         // TODO add more output formats
         else
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(state, params, pcmf32s);
             json jres = json{
                 {"text", results}
             };
             res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
         }
-
-        // reset params to thier defaults
-        params = default_params;
     });
     svr.Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -963,20 +1196,23 @@ int main(int argc, char ** argv) {
             return;
         }
 
-        // clean up
-        whisper_free(ctx);
-
-        // whisper init
-        ctx = whisper_init_from_file_with_params(model.c_str(), cparams);
+        std::lock_guard<std::mutex> load_lock(load_mutex);
 
-        // TODO perhaps load prior model here instead of exit
-        if (ctx == nullptr) {
-            fprintf(stderr, "error: model init  failed, no model loaded must exit\n");
-            exit(1);
+        // requests keep being served by the current model while the new one is loaded
+        std::shared_ptr<whisper_server_model> model_new = whisper_server_model_load(model, cparams, params, sparams, queue);
+        if (model_new == nullptr) {
+            fprintf(stderr, "error: failed to load model '%s', keeping the current one\n", model.c_str());
+            const std::string error_resp = "{\"error\":\"failed to load model\"}";
+            res.set_content(error_resp, "application/json");
+            res.status = 500;
+            return;
         }
 
-        // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
-        whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+        // new requests use the new model, the old one is freed when its last request finishes
+        {
+            std::lock_guard<std::mutex> lock(model_mutex);
+            model_cur.swap(model_new);
+        }
 
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
@@ -1001,7 +1237,7 @@ int main(int argc, char ** argv) {
     svr.set_error_handler([](const Request &req, Response &res) {
         if (res.status == 400) {
             res.set_content("Invalid request", "text/plain");
-        } else if (res.status != 500) {
+        } else if (res.status != 500 && res.status != 503) {
             res.set_content("File Not Found (" + req.path + ")", "text/plain");
             res.status = 404;
         }
@@ -1029,8 +1265,7 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    whisper_print_timings(ctx);
-    whisper_free(ctx);
+    whisper_print_timings(model_get()->ctx);
 
     return 0;
 }
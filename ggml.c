@@ -17948,6 +17948,7 @@ struct ggml_compute_state {
     int ith;
     struct ggml_compute_state_shared * shared;
     enum ggml_status ec;
+    struct ggml_threadpool * threadpool; // set for the persistent workers of a threadpool
 };
 
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
@@ -18576,6 +18577,225 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     return cplan;
 }
 
+//
+// threadpool
+//
+
+#if defined(_WIN32)
+typedef SRWLOCK            ggml_mutex_t;
+typedef CONDITION_VARIABLE ggml_cond_t;
+
+#define ggml_mutex_init(m)      InitializeSRWLock(m)
+#define ggml_mutex_destroy(m)   UNUSED(m)
+#define ggml_mutex_lock(m)      AcquireSRWLockExclusive(m)
+#define ggml_mutex_unlock(m)    ReleaseSRWLockExclusive(m)
+#define ggml_cond_init(c)       InitializeConditionVariable(c)
+#define ggml_cond_destroy(c)    UNUSED(c)
+#define ggml_cond_wait(c, m)    SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define ggml_cond_broadcast(c)  WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t ggml_mutex_t;
+typedef pthread_cond_t  ggml_cond_t;
+
+#define ggml_mutex_init(m)      pthread_mutex_init(m, NULL)
+#define ggml_mutex_destroy(m)   pthread_mutex_destroy(m)
+#define ggml_mutex_lock(m)      pthread_mutex_lock(m)
+#define ggml_mutex_unlock(m)    pthread_mutex_unlock(m)
+#define ggml_cond_init(c)       pthread_cond_init(c, NULL)
+#define ggml_cond_destroy(c)    pthread_cond_destroy(c)
+#define ggml_cond_wait(c, m)    pthread_cond_wait(c, m)
+#define ggml_cond_broadcast(c)  pthread_cond_broadcast(c)
+#endif
+
+struct ggml_threadpool {
+    struct ggml_threadpool_params params;
+
+    // workers[0] is unused - the thread calling ggml_graph_compute() is thread 0
+    struct ggml_compute_state * workers;
+
+    ggml_mutex_t mutex;
+    ggml_cond_t  cond;
+
+    atomic_int generation; // incremented for every graph
+    atomic_int n_active;   // number of threads taking part in the current graph
+    atomic_int n_pending;  // number of workers still running the current graph
+    atomic_bool stop;
+};
+
+static inline void ggml_thread_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#if defined(__gnu_linux__)
+static void ggml_thread_set_cpu_affinity(int ith) {
+    const int n_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus <= 0) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(ith % n_cpus, &cpus);
+
+    const int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+}
+#else
+static void ggml_thread_set_cpu_affinity(int ith) { UNUSED(ith); }
+#endif
+
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * threadpool = state->threadpool;
+
+    if (threadpool->params.affinity) {
+        ggml_thread_set_cpu_affinity(state->ith);
+    }
+
+    int generation = 0;
+
+    while (true) {
+        // spin for a while - graphs are often submitted back to back (e.g. one per decoded token)
+        for (int i = 0; i < threadpool->params.n_spin; i++) {
+            if (atomic_load(&threadpool->generation) != generation || atomic_load(&threadpool->stop)) {
+                break;
+            }
+            ggml_thread_cpu_relax();
+        }
+
+        // then sleep until the next graph
+        // generation and n_active are read together under the mutex - a worker that wakes up late for a graph
+        // it does not take part in must not pair its generation with the n_active of the graph after it
+        int n_active = 0;
+        {
+            ggml_mutex_lock(&threadpool->mutex);
+            while (atomic_load(&threadpool->generation) == generation && !atomic_load(&threadpool->stop)) {
+                ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
+            }
+            generation = atomic_load(&threadpool->generation);
+            n_active   = atomic_load(&threadpool->n_active);
+            ggml_mutex_unlock(&threadpool->mutex);
+        }
+
+        if (atomic_load(&threadpool->stop)) {
+            break;
+        }
+
+        if (state->ith < n_active) {
+            ggml_graph_compute_thread(state);
+            atomic_fetch_sub(&threadpool->n_pending, 1);
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool_params ggml_threadpool_default_params(int n_threads) {
+    struct ggml_threadpool_params params = {
+        /*.n_threads =*/ n_threads,
+        /*.n_spin    =*/ 1 << 16,
+        /*.affinity  =*/ false,
+    };
+    return params;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(struct ggml_threadpool_params params) {
+    GGML_ASSERT(params.n_threads > 0);
+
+    struct ggml_threadpool * threadpool = GGML_MALLOC(sizeof(struct ggml_threadpool));
+
+    threadpool->params  = params;
+    threadpool->workers = GGML_MALLOC(sizeof(struct ggml_compute_state)*params.n_threads);
+
+    ggml_mutex_init(&threadpool->mutex);
+    ggml_cond_init(&threadpool->cond);
+
+    atomic_store(&threadpool->generation, 0);
+    atomic_store(&threadpool->n_active,   0);
+    atomic_store(&threadpool->n_pending,  0);
+    atomic_store(&threadpool->stop,       false);
+
+    for (int j = 1; j < params.n_threads; ++j) {
+        threadpool->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = NULL,
+            .ec         = GGML_STATUS_SUCCESS,
+            .threadpool = threadpool,
+        };
+
+        const int rc = ggml_thread_create(&threadpool->workers[j].thrd, NULL, ggml_threadpool_thread, &threadpool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return threadpool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * threadpool) {
+    if (!threadpool) {
+        return;
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    atomic_store(&threadpool->stop, true);
+    ggml_cond_broadcast(&threadpool->cond);
+    ggml_mutex_unlock(&threadpool->mutex);
+
+    for (int j = 1; j < threadpool->params.n_threads; ++j) {
+        const int rc = ggml_thread_join(threadpool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_cond_destroy(&threadpool->cond);
+    ggml_mutex_destroy(&threadpool->mutex);
+
+    GGML_FREE(threadpool->workers);
+    GGML_FREE(threadpool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool) {
+    return threadpool->params.n_threads;
+}
+
+// hand the graph to the first n_threads - 1 workers
+static void ggml_threadpool_kickoff(struct ggml_threadpool * threadpool, struct ggml_compute_state_shared * shared, int n_threads) {
+    for (int j = 1; j < n_threads; ++j) {
+        threadpool->workers[j].shared = shared;
+        threadpool->workers[j].ec     = GGML_STATUS_SUCCESS;
+    }
+
+    atomic_store(&threadpool->n_pending, n_threads - 1);
+
+    ggml_mutex_lock(&threadpool->mutex);
+    atomic_store(&threadpool->n_active, n_threads);
+    atomic_fetch_add(&threadpool->generation, 1);
+    ggml_cond_broadcast(&threadpool->cond);
+    ggml_mutex_unlock(&threadpool->mutex);
+}
+
+// the workers leave the graph at the same node as the calling thread, so this wait is short
+static enum ggml_status ggml_threadpool_wait(struct ggml_threadpool * threadpool, int n_threads, enum ggml_status status) {
+    while (atomic_load(&threadpool->n_pending) > 0) {
+        ggml_thread_cpu_relax();
+    }
+
+    for (int j = 1; j < n_threads; ++j) {
+        if (threadpool->workers[j].ec != GGML_STATUS_SUCCESS) {
+            status = threadpool->workers[j].ec;
+        }
+    }
+
+    return status;
+}
+
 enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -18588,6 +18808,11 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     const int n_threads = cplan->n_threads;
 
+    struct ggml_threadpool * threadpool = cplan->threadpool;
+    if (threadpool && threadpool->params.n_threads < n_threads) {
+        threadpool = NULL;
+    }
+
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
@@ -18603,7 +18828,9 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
     // create thread pool
-    if (n_threads > 1) {
+    if (threadpool) {
+        ggml_threadpool_kickoff(threadpool, &state_shared, n_threads);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
                 .thrd   = 0,
@@ -18633,7 +18860,9 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
     clear_numa_thread_affinity();
 
     // join or kill thread pool
-    if (n_threads > 1) {
+    if (threadpool) {
+        compute_status = ggml_threadpool_wait(threadpool, n_threads, compute_status);
+    } else if (n_threads > 1) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
@@ -601,6 +601,16 @@ extern "C" {
     // If it returns true, the computation is aborted
     typedef bool (*ggml_abort_callback)(void * data);
 
+    // persistent worker threads that ggml_graph_compute() can run on instead of spawning threads per call
+    // a threadpool can be used by a single ggml_graph_compute() call at a time
+    struct ggml_threadpool;
+
+    struct ggml_threadpool_params {
+        int  n_threads; // max number of threads per graph, including the calling thread
+        int  n_spin;    // number of polls an idle worker spins before going to sleep
+        bool affinity;  // pin the worker threads to CPUs
+    };
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -612,6 +622,9 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // optional, threads are created per call when NULL or when it has fewer than n_threads
+        struct ggml_threadpool * threadpool;
     };
 
     enum ggml_cgraph_eval_order {
@@ -1983,6 +1996,11 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    GGML_API struct ggml_threadpool_params ggml_threadpool_default_params(int n_threads);
+    GGML_API struct ggml_threadpool *      ggml_threadpool_new (struct ggml_threadpool_params params);
+    GGML_API void                          ggml_threadpool_free(struct ggml_threadpool * threadpool);
+    GGML_API int                           ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
     GGML_API void                 ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
@@ -0,0 +1,92 @@
+# Rewrite a ggml whisper model so that the data of every tensor starts at an aligned file offset
+#
+# The tensor names are padded with NUL bytes, the rest of the file is unchanged.
+# whisper.cpp maps such a file and uses the weights in place on the CPU backend (whisper_context_params.use_mmap),
+# so processes loading the same model share its pages instead of holding a copy each.
+#
+# Usage:
+#
+#   python models/convert-ggml-to-aligned.py models/ggml-base.en.bin models/ggml-base.en-aligned.bin
+#
+# Quantize the model first if needed - the quantize tool drops the padding.
+#
+
+import struct
+import sys
+
+if len(sys.argv) < 3:
+    print("Usage: convert-ggml-to-aligned.py model.bin model-aligned.bin [alignment]\n")
+    sys.exit(1)
+
+fname_inp = sys.argv[1]
+fname_out = sys.argv[2]
+alignment = int(sys.argv[3]) if len(sys.argv) > 3 else 32
+
+# ggml type -> (type size, block size)
+type_sizes = {
+     0: (  4,   1), #  f32
+     1: (  2,   1), #  f16
+     2: ( 18,  32), # q4_0
+     3: ( 20,  32), # q4_1
+     6: ( 22,  32), # q5_0
+     7: ( 24,  32), # q5_1
+     8: ( 34,  32), # q8_0
+    10: ( 84, 256), # q2_K
+    11: (110, 256), # q3_K
+    12: (144, 256), # q4_K
+    13: (176, 256), # q5_K
+    14: (210, 256), # q6_K
+}
+
+with open(fname_inp, "rb") as fin, open(fname_out, "wb") as fout:
+    # magic + hparams
+    fout.write(fin.read(4*12))
+
+    # mel filters
+    n_mel, n_fft = struct.unpack("ii", fin.read(8))
+    fout.write(struct.pack("ii", n_mel, n_fft))
+    fout.write(fin.read(4*n_mel*n_fft))
+
+    # vocab
+    n_vocab, = struct.unpack("i", fin.read(4))
+    fout.write(struct.pack("i", n_vocab))
+    for _ in range(n_vocab):
+        length, = struct.unpack("I", fin.read(4))
+        fout.write(struct.pack("I", length))
+        fout.write(fin.read(length))
+
+    n_tensors = 0
+
+    while True:
+        header = fin.read(12)
+        if len(header) < 12:
+            break
+
+        n_dims, length, ttype = struct.unpack("iii", header)
+
+        dims = struct.unpack("i"*n_dims, fin.read(4*n_dims))
+        name = fin.read(length).rstrip(b"\0")
+
+        if ttype not in type_sizes:
+            print(f"{name.decode()}: unsupported tensor type {ttype}")
+            sys.exit(1)
+
+        nelements = 1
+        for d in dims:
+            nelements *= d
+
+        type_size, blck_size = type_sizes[ttype]
+        nbytes = nelements*type_size//blck_size
+
+        # pad the name so that the data that follows it is aligned
+        offset  = fout.tell() + 12 + 4*n_dims + len(name)
+        padding = (alignment - offset % alignment) % alignment
+
+        fout.write(struct.pack("iii", n_dims, len(name) + padding, ttype))
+        fout.write(struct.pack("i"*n_dims, *dims))
+        fout.write(name + b"\0"*padding)
+        fout.write(fin.read(nbytes))
+
+        n_tensors += 1
+
+    print(f"Done. Output file: {fname_out}, {n_tensors} tensors aligned to {alignment} bytes")
@@ -0,0 +1,148 @@
+// check of the streaming log mel spectrogram against whisper_pcm_to_mel()
+//
+// a long signal is pushed in uneven chunks and windows are taken at different points of the stream. the window
+// is an approximation of the batch spectrogram (see whisper.h), so the columns next to the start of the window,
+// which see the earlier audio instead of the reflective padding, are skipped and the rest is compared within
+// a tolerance
+//
+
+#include "whisper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#define FRAME_STEP  160
+#define FRAME_SIZE  400
+
+// columns whose FFT frame overlaps the start of the window
+#define N_SKIP ((FRAME_SIZE/2 + FRAME_STEP - 1)/FRAME_STEP)
+
+#define TOLERANCE 1e-3f
+
+static std::vector<float> make_signal(int n_samples) {
+    std::vector<float> pcm(n_samples);
+    for (int i = 0; i < n_samples; ++i) {
+        const float t = (float) i/WHISPER_SAMPLE_RATE;
+
+        // slow envelope, so that every window has its loudest part away from its start
+        const float env = 0.05f + 0.45f*(0.5f - 0.5f*cosf(2.0f*(float) M_PI*t/3.0f));
+
+        pcm[i] = env*(0.6f*sinf(2.0f*(float) M_PI*220.0f*t) + 0.3f*sinf(2.0f*(float) M_PI*1375.0f*t) + 0.1f*sinf(2.0f*(float) M_PI*3920.0f*t));
+    }
+    return pcm;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.bin\n", argv[0]);
+        return 1;
+    }
+
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = false;
+
+    struct whisper_context * ctx = whisper_init_from_file_with_params_no_state(argv[1], cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "failed to load model '%s'\n", argv[1]);
+        return 1;
+    }
+
+    struct whisper_state * st_stream = whisper_init_state(ctx);
+    struct whisper_state * st_batch  = whisper_init_state(ctx);
+
+    const int n_mel   = whisper_model_n_mels(ctx);
+    const int n_total = 12*WHISPER_SAMPLE_RATE;
+
+    const std::vector<float> pcm = make_signal(n_total);
+
+    if (whisper_stream_mel_reset_with_state(ctx, st_stream, 10000) != 0) {
+        fprintf(stderr, "failed to reset the stream\n");
+        return 1;
+    }
+
+    // window lengths, both on and off the frame grid
+    static const int n_window[] = { 3*WHISPER_SAMPLE_RATE, 5*WHISPER_SAMPLE_RATE + 77, 8*WHISPER_SAMPLE_RATE + 159 };
+
+    static const int chunks[] = { 1000, 3331, 160, 4799, 57 };
+
+    int n_pushed = 0;
+    int n_check  = 0;
+    int n_fail   = 0;
+
+    for (int ic = 0; n_pushed < n_total; ++ic) {
+        const int n = std::min(chunks[ic % (int) (sizeof(chunks)/sizeof(chunks[0]))], n_total - n_pushed);
+        if (whisper_stream_mel_push_with_state(ctx, st_stream, pcm.data() + n_pushed, n) != 0) {
+            fprintf(stderr, "failed to push %d samples\n", n);
+            return 1;
+        }
+        n_pushed += n;
+
+        // take a window roughly every second
+        if (ic % 7 != 6) {
+            continue;
+        }
+
+        for (int nw : n_window) {
+            if (nw > n_pushed) {
+                continue;
+            }
+
+            if (whisper_stream_mel_window_with_state(ctx, st_stream, nw) != 0) {
+                fprintf(stderr, "failed to build the window of %d samples\n", nw);
+                return 1;
+            }
+
+            int n_len_stream = 0;
+            const std::vector<float> mel_stream = [&]() {
+                const float * data = whisper_get_mel_from_state(st_stream, &n_len_stream);
+                return std::vector<float>(data, data + n_mel*n_len_stream);
+            }();
+
+            // the stream starts the window at the next frame boundary
+            const int start = ((n_pushed - nw + FRAME_STEP - 1)/FRAME_STEP)*FRAME_STEP;
+
+            if (whisper_pcm_to_mel_with_state(ctx, st_batch, pcm.data() + start, n_pushed - start, 1) != 0) {
+                fprintf(stderr, "failed to compute the batch spectrogram\n");
+                return 1;
+            }
+
+            int n_len_batch = 0;
+            const float * mel_batch = whisper_get_mel_from_state(st_batch, &n_len_batch);
+
+            if (n_len_stream != n_len_batch) {
+                fprintf(stderr, "pushed %d, window %d: length mismatch: %d != %d\n", n_pushed, nw, n_len_stream, n_len_batch);
+                n_fail++;
+                continue;
+            }
+
+            float max_diff = 0.0f;
+            for (int j = 0; j < n_mel; ++j) {
+                for (int i = N_SKIP; i < n_len_batch; ++i) {
+                    max_diff = std::max(max_diff, fabsf(mel_stream[j*n_len_stream + i] - mel_batch[j*n_len_batch + i]));
+                }
+            }
+
+            if (max_diff > TOLERANCE) {
+                fprintf(stderr, "pushed %d, window %d: max difference %f exceeds %f\n", n_pushed, nw, max_diff, TOLERANCE);
+                n_fail++;
+            }
+
+            n_check++;
+        }
+    }
+
+    whisper_free_state(st_stream);
+    whisper_free_state(st_batch);
+    whisper_free(ctx);
+
+    if (n_check == 0 || n_fail > 0) {
+        fprintf(stderr, "%d of %d windows failed\n", n_fail, n_check);
+        return 1;
+    }
+
+    printf("OK (%d windows)\n", n_check);
+
+    return 0;
+}
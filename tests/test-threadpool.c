@@ -0,0 +1,133 @@
+// stress test of the ggml threadpool
+//
+// one pool runs graphs with a thread count that changes from graph to graph, so that the workers that sat out
+// a graph wake up while the next, larger one is being submitted. every result is compared against a
+// computation without the pool
+//
+
+#include "ggml.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_EMBD 64
+
+#ifndef N_LAYERS
+#define N_LAYERS 2
+#endif
+
+#ifndef N_ITER
+#define N_ITER 1000
+#endif
+
+static struct ggml_cgraph * build_graph(struct ggml_context * ctx, struct ggml_tensor ** out) {
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N_EMBD, N_EMBD);
+    ggml_set_name(x, "x");
+
+    struct ggml_tensor * cur = x;
+    for (int il = 0; il < N_LAYERS; ++il) {
+        struct ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N_EMBD, N_EMBD);
+        float * data = (float *) w->data;
+        for (int i = 0; i < N_EMBD*N_EMBD; ++i) {
+            data[i] = (float) ((i*7 + il*13) % 17 - 8)/(8.0f*N_EMBD);
+        }
+
+        cur = ggml_mul_mat(ctx, w, cur);
+        cur = ggml_add(ctx, cur, x);
+        cur = ggml_soft_max(ctx, cur);
+    }
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, cur);
+
+    *out = cur;
+
+    return gf;
+}
+
+static void set_input(struct ggml_cgraph * gf, int iter) {
+    struct ggml_tensor * x = ggml_graph_get_tensor(gf, "x");
+    float * data = (float *) x->data;
+    for (int i = 0; i < N_EMBD*N_EMBD; ++i) {
+        data[i] = (float) ((i + iter) % 11)/11.0f;
+    }
+}
+
+static enum ggml_status compute(struct ggml_cgraph * gf, int n_threads, struct ggml_threadpool * threadpool, uint8_t ** work, size_t * work_size) {
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads);
+    if (cplan.work_size > *work_size) {
+        *work      = realloc(*work, cplan.work_size);
+        *work_size = cplan.work_size;
+    }
+    cplan.work_data  = *work;
+    cplan.threadpool = threadpool;
+
+    return ggml_graph_compute(gf, &cplan);
+}
+
+int main(void) {
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * out = NULL;
+    struct ggml_cgraph * gf  = build_graph(ctx, &out);
+
+    // spin as little as possible, so that the workers go to sleep and wake up late
+    struct ggml_threadpool_params tp_params = ggml_threadpool_default_params(4);
+    tp_params.n_spin = 1;
+
+    struct ggml_threadpool * threadpool = ggml_threadpool_new(tp_params);
+
+    uint8_t * work      = NULL;
+    size_t    work_size = 0;
+
+    float ref[N_EMBD*N_EMBD];
+
+    static const int n_threads[] = { 2, 4, 2, 4, 3, 1, 4 };
+
+    int n_fail = 0;
+
+    for (int iter = 0; iter < N_ITER; ++iter) {
+        set_input(gf, iter);
+        if (compute(gf, 1, NULL, &work, &work_size) != GGML_STATUS_SUCCESS) {
+            fprintf(stderr, "iter %d: reference computation failed\n", iter);
+            return 1;
+        }
+        memcpy(ref, out->data, sizeof(ref));
+
+        set_input(gf, iter);
+        const int nt = n_threads[iter % (int) (sizeof(n_threads)/sizeof(n_threads[0]))];
+        if (compute(gf, nt, threadpool, &work, &work_size) != GGML_STATUS_SUCCESS) {
+            fprintf(stderr, "iter %d: computation on the threadpool failed (n_threads = %d)\n", iter, nt);
+            return 1;
+        }
+
+        for (int i = 0; i < N_EMBD*N_EMBD; ++i) {
+            if (fabsf(((float *) out->data)[i] - ref[i]) > 1e-5f) {
+                fprintf(stderr, "iter %d: mismatch at %d (n_threads = %d): %f != %f\n", iter, i, nt, ((float *) out->data)[i], ref[i]);
+                n_fail++;
+                break;
+            }
+        }
+    }
+
+    ggml_threadpool_free(threadpool);
+    free(work);
+    ggml_free(ctx);
+
+    if (n_fail > 0) {
+        fprintf(stderr, "%d of %d graphs failed\n", n_fail, N_ITER);
+        return 1;
+    }
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -27,13 +27,17 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <condition_variable>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
 #include <thread>
@@ -42,6 +46,21 @@
 #include <random>
 #include <functional>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define WHISPER_USE_MMAP_POSIX
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#define WHISPER_USE_MMAP_WIN32
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -178,9 +197,11 @@ static bool ggml_graph_compute_helper(
 static bool ggml_graph_compute_helper(
        struct ggml_backend * backend,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+    struct ggml_threadpool * threadpool) {
     if (ggml_backend_is_cpu(backend)) {
         ggml_backend_cpu_set_n_threads(backend, n_threads);
+        ggml_backend_cpu_set_threadpool(backend, threadpool);
     }
 #ifdef GGML_USE_METAL
     if (ggml_backend_is_metal(backend)) {
@@ -380,6 +401,103 @@ static const std::map<whisper_alignment_heads_preset, whisper_aheads> g_aheads {
 
 static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_params & cparams, int il, int32_t n_text_layer, int32_t n_head);
 
+// persistent worker threads, reused across calls
+// a pool is driven by a single thread at a time (the owner of the whisper_state)
+struct whisper_worker_pool {
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    std::vector<std::thread> threads;
+
+    const std::function<void(int)> * task = nullptr;
+
+    int n_active  = 0; // number of threads taking part in the current task, including the caller
+    int n_pending = 0; // number of workers that have not finished the current task yet
+
+    uint64_t generation = 0;
+
+    bool stop = false;
+};
+
+static void whisper_worker_pool_loop(whisper_worker_pool & pool, int ith) {
+    uint64_t generation = 0;
+
+    while (true) {
+        const std::function<void(int)> * task = nullptr;
+
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.cv_work.wait(lock, [&] { return pool.stop || pool.generation != generation; });
+
+            if (pool.stop) {
+                return;
+            }
+
+            generation = pool.generation;
+
+            if (ith >= pool.n_active) {
+                continue;
+            }
+
+            task = pool.task;
+        }
+
+        (*task)(ith);
+
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (--pool.n_pending == 0) {
+                pool.cv_done.notify_one();
+            }
+        }
+    }
+}
+
+// call fn(ith) for ith = 0 .. n_threads - 1 and wait for all of them
+// ith == 0 runs on the calling thread, the rest on the pool, which grows on demand
+static void whisper_worker_pool_run(whisper_worker_pool & pool, int n_threads, const std::function<void(int)> & fn) {
+    if (n_threads <= 1) {
+        fn(0);
+        return;
+    }
+
+    while ((int) pool.threads.size() < n_threads - 1) {
+        const int ith = (int) pool.threads.size() + 1;
+        pool.threads.emplace_back(whisper_worker_pool_loop, std::ref(pool), ith);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.task      = &fn;
+        pool.n_active  = n_threads;
+        pool.n_pending = n_threads - 1;
+        pool.generation++;
+    }
+    pool.cv_work.notify_all();
+
+    fn(0);
+
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.cv_done.wait(lock, [&] { return pool.n_pending == 0; });
+        pool.task = nullptr;
+    }
+}
+
+static void whisper_worker_pool_free(whisper_worker_pool & pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stop = true;
+    }
+    pool.cv_work.notify_all();
+
+    for (auto & t : pool.threads) {
+        t.join();
+    }
+    pool.threads.clear();
+}
+
 struct whisper_mel {
     int n_len;
     int n_len_org;
@@ -388,11 +506,109 @@ struct whisper_mel {
     std::vector<float> data;
 };
 
+// incremental mel state used by whisper_stream_mel_*()
+// frame f covers the stream samples [f*hop - n_fft/2, f*hop + n_fft/2), the stream is zero-padded on the left
+struct whisper_mel_stream {
+    int n_mel  = 0;
+    int n_ring = 0; // max number of complete columns kept
+
+    int64_t n_pushed = 0; // total number of samples pushed
+    int64_t n_frames = 0; // number of frames with all of their samples available
+
+    // samples starting at stream position pcm_off - enough to build the next (incomplete) frames
+    int64_t pcm_off = 0;
+    std::vector<float> pcm;
+
+    // raw log10 mel columns, [n_ring][n_mel], frame f is stored at slot f % n_ring
+    std::vector<float> ring;
+
+    std::vector<float> hann;
+    std::vector<float> fft_in;
+    std::vector<float> fft_out;
+};
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // sparse form of data, built at load time (see whisper_filters_init_sparse)
+    // band j covers the bins [sparse_start[j], sparse_start[j] + sparse_len[j]) with weights at sparse_data[sparse_offs[j]]
+    std::vector<int32_t> sparse_start;
+    std::vector<int32_t> sparse_len;
+    std::vector<int32_t> sparse_offs;
+    std::vector<float>   sparse_data;
+};
+
+// the triangular mel filters are non-zero only over a few bins each
+static void whisper_filters_init_sparse(whisper_filters & filters) {
+    filters.sparse_start.resize(filters.n_mel);
+    filters.sparse_len  .resize(filters.n_mel);
+    filters.sparse_offs .resize(filters.n_mel);
+    filters.sparse_data .clear();
+
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float * w = filters.data.data() + j*filters.n_fft;
+
+        int k0 = 0;
+        int k1 = filters.n_fft;
+        while (k0 < k1 && w[k0]     == 0.0f) k0++;
+        while (k1 > k0 && w[k1 - 1] == 0.0f) k1--;
+
+        filters.sparse_start[j] = k0;
+        filters.sparse_len[j]   = k1 - k0;
+        filters.sparse_offs[j]  = filters.sparse_data.size();
+
+        filters.sparse_data.insert(filters.sparse_data.end(), w + k0, w + k1);
+    }
+}
+
+#define WHISPER_FFT_MAX_RADIX 16
+
+// precomputed real-input FFT of size n (see whisper_fft_plan_init)
+struct whisper_fft_plan {
+    struct stage {
+        int p; // radix
+        int L; // length of the sub-transforms combined by this stage
+
+        size_t tw_off;
+        size_t root_off;
+    };
+
+    int n = 0;
+
+    std::vector<int>   perm;     // digit-reversal permutation of the n/2 packed input pairs
+    std::vector<stage> stages;
+    std::vector<float> twiddles; // complex, per stage
+    std::vector<float> roots;    // complex, per stage
+    std::vector<float> split;    // complex, W_n^k for k = 0 .. n/2
+};
+
+// trie over sequences of T, see whisper_trie_build()
+// the children of a node are stored next to each other, sorted by the label on their incoming edge
+template<typename T>
+struct whisper_trie {
+    struct node {
+        int32_t id = -1; // the value of the key spelled by the path to this node, -1 if none
+
+        int32_t child   = 0; // index of the first child
+        int32_t n_child = 0;
+    };
+
+    std::vector<node> nodes;  // nodes[0] is the root
+    std::vector<T>    labels; // labels[i] is the label on the edge into nodes[i]
+
+    // the child of node i along label c, -1 if there is none
+    int32_t next(int32_t i, T c) const {
+        const node & n = nodes[i];
+
+        const T * beg = labels.data() + n.child;
+        const T * end = beg + n.n_child;
+        const T * it  = std::lower_bound(beg, end, c);
+
+        return it != end && *it == c ? n.child + int32_t(it - beg) : -1;
+    }
 };
 
 struct whisper_vocab {
@@ -404,6 +620,9 @@ struct whisper_vocab {
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 
+    // the keys of token_to_id, used by tokenize()
+    whisper_trie<uint8_t> trie;
+
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
     id token_sot        = 50257;
@@ -676,6 +895,21 @@ struct whisper_kv_cache {
     ggml_backend_buffer_t buffer = nullptr;
 };
 
+// read-only mapping of a model file
+// it is the source of the model loader and, when the tensor data is aligned, holds the CPU weights
+struct whisper_mmap {
+    uint8_t * addr = nullptr;
+    size_t    size = 0;
+    size_t    pos  = 0; // read position of the model loader
+
+    bool locked = false;
+
+#ifdef WHISPER_USE_MMAP_WIN32
+    HANDLE hfile = INVALID_HANDLE_VALUE;
+    HANDLE hmap  = nullptr;
+#endif
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -716,6 +950,10 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     ggml_backend_buffer_t buffer = nullptr;
 
+    // mapped model file (whisper_context_params.use_mmap)
+    // when the weights are used in place, `buffer` points into the mapping
+    whisper_mmap * mapping = nullptr;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -753,6 +991,25 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// summary of the processed logits of a decoder, see whisper_logits_info_compute()
+struct whisper_logits_info {
+    float lse    = -INFINITY; // log-sum-exp over all tokens
+    float ts_lse = -INFINITY; // log-sum-exp over the timestamp tokens
+
+    float max_text = -INFINITY; // largest logit of a text token
+
+    whisper_token id  = 0; // the token with the largest logit
+    whisper_token tid = 0; // the timestamp token with the largest logit
+};
+
+// see whisper_phrases_init()
+struct whisper_phrases {
+    whisper_token token_eot;
+
+    // the tokens of the phrases, the id of a node is the index of the phrase that ends there
+    whisper_trie<whisper_token> trie;
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // the currently generated sequence of tokens
@@ -768,10 +1025,13 @@ struct whisper_decoder {
     bool completed; // has the decoder completed the current segment?
     bool has_ts;    // have we already sampled a non-beg timestamp token for the current segment?
 
-    // new token probs, logits and logprobs after the last whisper_decode (1-dimensional array: [n_vocab])
-    std::vector<float> probs;
+    int32_t phrase_node; // the node of whisper_full_params.phrases reached by the text tokens so far
+
+    // new token logits after the last whisper_decode, filtered and scaled by the temperature (1-dimensional array: [n_vocab])
+    // the logprob of token i is logits[i] - logits_info.lse
     std::vector<float> logits;
-    std::vector<float> logprobs;
+
+    whisper_logits_info logits_info;
 
     // work container used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
@@ -810,6 +1070,18 @@ struct whisper_state {
     whisper_kv_cache kv_cross;
 
     whisper_mel mel;
+    whisper_mel_stream mel_stream;
+
+    // mel spectrogram scratch, reused across calls
+    std::vector<float> mel_hann;
+    std::vector<float> mel_pcm; // padded input, read by all workers
+    std::vector<std::vector<float>> mel_fft_in;  // per thread
+    std::vector<std::vector<float>> mel_fft_out; // per thread
+
+    whisper_worker_pool workers;
+
+    // persistent threads for the CPU graph compute
+    ggml_threadpool * threadpool = nullptr;
 
     whisper_batch batch;
 
@@ -836,6 +1108,11 @@ struct whisper_state {
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // tokens suppressed by whisper_process_logits() before / after the logits_filter_callback
+    // they depend only on the vocab and the params, so whisper_full_with_state() collects them once
+    std::vector<whisper_token> logits_suppress_pre;
+    std::vector<whisper_token> logits_suppress_post;
+
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
@@ -880,6 +1157,8 @@ struct whisper_context {
     whisper_model model;
     whisper_vocab vocab;
 
+    whisper_fft_plan fft_plan; // mel spectrogram FFT, read-only after init
+
     whisper_state * state = nullptr;
 
     ggml_backend_t backend = nullptr;
@@ -887,6 +1166,78 @@ struct whisper_context {
     std::string path_model; // populated by whisper_init_from_file_with_params()
 };
 
+// [EXPERIMENTAL] requests of concurrent whisper_full_with_state() calls that are evaluated together
+// the caller that finds the queue idle becomes the leader: it waits up to t_wait_us for the other
+// active calls to queue a compatible request, then evaluates up to n_max of them (its own first)
+template<typename T>
+struct whisper_batch_queue {
+    int     n_max     = 1;
+    int64_t t_wait_us = 0;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::vector<T *> pending;
+
+    int  n_active = 0;     // whisper_full_with_state() calls currently using the queue
+    bool busy     = false; // a leader is collecting or computing a batch
+};
+
+// encoder windows of several states evaluated in a single graph
+// each result is written into the kv_cross of the state that queued the window
+struct whisper_encoder_batch {
+    whisper_context * ctx = nullptr;
+
+    ggml_backend_t backend = nullptr;
+
+    ggml_threadpool * threadpool = nullptr;
+
+    whisper_allocr alloc;
+
+    std::vector<float> inp_mel;
+
+    struct window {
+        whisper_state * state;
+
+        int mel_offset;
+        int n_ctx;
+
+        bool done;
+        bool ok;
+    };
+
+    whisper_batch_queue<window> queue;
+};
+
+// decoder steps of several states evaluated in a single graph
+// the layer weights are applied to the tokens of all steps at once, while the self- and
+// cross-attention of each step use the KV caches of the state that queued it
+struct whisper_decoder_batch {
+    whisper_context * ctx = nullptr;
+
+    ggml_backend_t backend = nullptr;
+
+    ggml_threadpool * threadpool = nullptr;
+
+    whisper_allocr alloc;
+
+    int n_nodes = 0; // graph size for the largest batch
+
+    std::vector<whisper_token> inp_embd;
+    std::vector<whisper_pos>   inp_pos;
+
+    struct step {
+        whisper_state * state;
+
+        const whisper_batch * batch;
+
+        bool done;
+        bool ok;
+    };
+
+    whisper_batch_queue<step> queue;
+};
+
 struct whisper_global {
     // We save the log callback globally
     ggml_log_callback log_callback = whisper_log_callback_default;
@@ -901,6 +1252,140 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
     BYTESWAP_VALUE(dest);
 }
 
+static void whisper_mmap_free(whisper_mmap * mapping);
+
+// map the whole file read-only
+// with prefetch, the file is read into the page cache now instead of on first use
+static whisper_mmap * whisper_mmap_init(const char * fname, bool prefetch) {
+#if defined(WHISPER_USE_MMAP_POSIX)
+    const int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (prefetch) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        WHISPER_LOG_WARN("%s: mmap failed: %s\n", __func__, strerror(errno));
+        return nullptr;
+    }
+
+    if (prefetch && posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED) != 0) {
+        WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed\n", __func__);
+    }
+
+    whisper_mmap * mapping = new whisper_mmap;
+
+    mapping->addr = (uint8_t *) addr;
+    mapping->size = st.st_size;
+
+    return mapping;
+#elif defined(WHISPER_USE_MMAP_WIN32)
+    GGML_UNUSED(prefetch);
+
+    whisper_mmap * mapping = new whisper_mmap;
+
+    mapping->hfile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (mapping->hfile == INVALID_HANDLE_VALUE) {
+        whisper_mmap_free(mapping);
+        return nullptr;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapping->hfile, &size) || size.QuadPart == 0) {
+        whisper_mmap_free(mapping);
+        return nullptr;
+    }
+
+    mapping->hmap = CreateFileMappingA(mapping->hfile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping->hmap == nullptr) {
+        WHISPER_LOG_WARN("%s: CreateFileMappingA failed: %lu\n", __func__, GetLastError());
+        whisper_mmap_free(mapping);
+        return nullptr;
+    }
+
+    mapping->addr = (uint8_t *) MapViewOfFile(mapping->hmap, FILE_MAP_READ, 0, 0, 0);
+    mapping->size = size.QuadPart;
+    if (mapping->addr == nullptr) {
+        WHISPER_LOG_WARN("%s: MapViewOfFile failed: %lu\n", __func__, GetLastError());
+        whisper_mmap_free(mapping);
+        return nullptr;
+    }
+
+    return mapping;
+#else
+    GGML_UNUSED(fname);
+    GGML_UNUSED(prefetch);
+
+    return nullptr;
+#endif
+}
+
+// keep the mapped pages resident
+static bool whisper_mmap_lock(whisper_mmap & mapping) {
+#if defined(WHISPER_USE_MMAP_POSIX)
+    if (mlock(mapping.addr, mapping.size) != 0) {
+        WHISPER_LOG_WARN("%s: mlock of %.2f MB failed: %s (check RLIMIT_MEMLOCK)\n", __func__, mapping.size/1e6, strerror(errno));
+        return false;
+    }
+#elif defined(WHISPER_USE_MMAP_WIN32)
+    if (!VirtualLock(mapping.addr, mapping.size)) {
+        WHISPER_LOG_WARN("%s: VirtualLock of %.2f MB failed: %lu\n", __func__, mapping.size/1e6, GetLastError());
+        return false;
+    }
+#else
+    return false;
+#endif
+
+    mapping.locked = true;
+
+    return true;
+}
+
+static void whisper_mmap_free(whisper_mmap * mapping) {
+    if (!mapping) {
+        return;
+    }
+
+#if defined(WHISPER_USE_MMAP_POSIX)
+    if (mapping->addr) {
+        if (mapping->locked) {
+            munlock(mapping->addr, mapping->size);
+        }
+        munmap(mapping->addr, mapping->size);
+    }
+#elif defined(WHISPER_USE_MMAP_WIN32)
+    if (mapping->addr) {
+        if (mapping->locked) {
+            VirtualUnlock(mapping->addr, mapping->size);
+        }
+        UnmapViewOfFile(mapping->addr);
+    }
+    if (mapping->hmap) {
+        CloseHandle(mapping->hmap);
+    }
+    if (mapping->hfile != INVALID_HANDLE_VALUE) {
+        CloseHandle(mapping->hfile);
+    }
+#endif
+
+    delete mapping;
+}
+
 static bool kv_cache_init(
         const struct whisper_hparams & hparams,
              struct whisper_kv_cache & cache,
@@ -1068,6 +1553,79 @@ static void whisper_kv_cache_seq_cp(
     }
 }
 
+// drop the cells of all other sequences and make seq_id the only owner of its cells
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id) {
+    uint32_t new_head = cache.size;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!cache.cells[i].has_seq_id(seq_id)) {
+            cache.cells[i].pos = -1;
+            cache.cells[i].seq_id.clear();
+            if (new_head == cache.size) new_head = i;
+        } else {
+            cache.cells[i].seq_id.clear();
+            cache.cells[i].seq_id.insert(seq_id);
+        }
+    }
+
+    // If we freed up a slot, set head to it so searching can start there.
+    if (new_head != cache.size) cache.head = new_head;
+}
+
+// hand the cells of sequence src[j] over to sequence j, for all j in [0, n_seq) at once
+// src[j] < 0 leaves sequence j as it is, sequence ids >= n_seq are not touched
+// equivalent to copying every src[j] to a temporary sequence and moving it back, but in a single pass
+static void whisper_kv_cache_seq_remap(
+        struct whisper_kv_cache & cache,
+         const whisper_seq_id   * src,
+                          int32_t n_seq) {
+    WHISPER_ASSERT(n_seq <= 32);
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        auto & cell = cache.cells[i];
+
+        if (cell.seq_id.empty()) {
+            continue;
+        }
+
+        uint32_t mask_old = 0;
+        for (const auto id : cell.seq_id) {
+            if (id >= 0 && id < n_seq) {
+                mask_old |= 1u << id;
+            }
+        }
+
+        uint32_t mask_new = 0;
+        for (int32_t j = 0; j < n_seq; ++j) {
+            const whisper_seq_id id = src[j] < 0 ? j : src[j];
+            if (mask_old & (1u << id)) {
+                mask_new |= 1u << j;
+            }
+        }
+
+        if (mask_new == mask_old) {
+            continue;
+        }
+
+        for (int32_t j = 0; j < n_seq; ++j) {
+            if (mask_new & (1u << j)) {
+                cell.seq_id.insert(j);
+            } else {
+                cell.seq_id.erase(j);
+            }
+        }
+
+        if (cell.seq_id.empty()) {
+            cell.pos = -1;
+        }
+    }
+
+    // same as after whisper_kv_cache_seq_cp()
+    cache.head = 0;
+}
+
 // [EXPERIMENTAL] Token-level timestamps with DTW
 static bool aheads_masks_init(
         const whisper_context_params & cparams,
@@ -1244,6 +1802,57 @@ static ggml_backend_t whisper_backend_init(const whisper_context_params & params
     return ggml_backend_cpu_init();
 }
 
+// build the trie of the given (key, value) pairs, the keys must be sorted and unique
+// the keys below each node form a contiguous range, so the children of a node can be laid out together, breadth-first
+template<typename T, typename K>
+static void whisper_trie_build(whisper_trie<T> & trie, const std::vector<std::pair<const K *, int32_t>> & keys) {
+    trie.nodes.clear();
+    trie.labels.clear();
+
+    trie.nodes.emplace_back();
+    trie.labels.push_back(T());
+
+    struct range {
+        int32_t node;
+        size_t  lo;
+        size_t  hi;
+        size_t  depth;
+    };
+
+    std::vector<range> queue = { { 0, 0, keys.size(), 0 } };
+
+    for (size_t q = 0; q < queue.size(); ++q) {
+        const range r = queue[q];
+
+        size_t lo = r.lo;
+
+        // a key ending here sorts before all the keys it is a prefix of
+        if (lo < r.hi && keys[lo].first->size() == r.depth) {
+            trie.nodes[r.node].id = keys[lo].second;
+            lo++;
+        }
+
+        trie.nodes[r.node].child = (int32_t) trie.nodes.size();
+
+        while (lo < r.hi) {
+            const T c = (T) (*keys[lo].first)[r.depth];
+
+            size_t hi = lo + 1;
+            while (hi < r.hi && (T) (*keys[hi].first)[r.depth] == c) {
+                hi++;
+            }
+
+            queue.push_back({ (int32_t) trie.nodes.size(), lo, hi, r.depth + 1 });
+
+            trie.nodes.emplace_back();
+            trie.labels.push_back(c);
+            trie.nodes[r.node].n_child++;
+
+            lo = hi;
+        }
+    }
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1356,6 +1965,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_init_sparse(filters);
     }
 
     // load vocab
@@ -1445,9 +2056,20 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
 
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
-    }
 
-    const ggml_type wtype = wctx.wtype;
+        // std::map keeps the tokens sorted bytewise
+        {
+            std::vector<std::pair<const whisper_vocab::token *, int32_t>> keys;
+            keys.reserve(vocab.token_to_id.size());
+            for (const auto & kv : vocab.token_to_id) {
+                keys.emplace_back(&kv.first, kv.second);
+            }
+
+            whisper_trie_build(vocab.trie, keys);
+        }
+    }
+
+    const ggml_type wtype = wctx.wtype;
     const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
 
     // create the ggml context
@@ -1674,15 +2296,21 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         return false;
     }
 
+    // with a mapped file, the loader reads from model.mapping and the tensors are allocated once
+    // their offsets in the file are known
+    whisper_mmap * mapping = model.mapping;
+
     // allocate tensors in the backend buffers
-    model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
-    if (!model.buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
-        return false;
-    }
+    if (!mapping) {
+        model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
+        if (!model.buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+            return false;
+        }
 
-    size_t size_main = ggml_backend_buffer_get_size(model.buffer);
-    WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6);
+        size_t size_main = ggml_backend_buffer_get_size(model.buffer);
+        WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6);
+    }
 
     // load weights
     {
@@ -1692,6 +2320,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         std::vector<char> read_buf;
 
+        // offset of the data of each tensor in the mapped file
+        std::vector<std::pair<ggml_tensor *, size_t>> tensor_offs;
+
         while (true) {
             int32_t n_dims;
             int32_t length;
@@ -1717,6 +2348,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
             name.assign(&tmp[0], tmp.size());
 
+            // aligned model files pad the name with NUL bytes so that the tensor data starts at an aligned offset
+            name.resize(strlen(name.c_str()));
+
             if (model.tensors.find(name) == model.tensors.end()) {
                 WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -1749,7 +2383,11 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
             //printf("%s: [%5.5s] %s\n", __func__, ggml_backend_name(backend), name.c_str());
 
-            if (ggml_backend_buffer_is_host(model.buffer)) {
+            if (mapping) {
+                // the data is used or copied once all tensors have been found
+                tensor_offs.emplace_back(tensor, mapping->pos);
+                mapping->pos += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(model.buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -1767,6 +2405,58 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             model.n_loaded++;
         }
 
+        if (mapping) {
+            if (mapping->pos > mapping->size) {
+                WHISPER_LOG_ERROR("%s: model file is truncated\n", __func__);
+                return false;
+            }
+
+            // the CPU backend can use the weights in place if every tensor in the file is aligned
+            bool in_place = ggml_backend_is_cpu(wctx.backend) && model.n_loaded == (int) model.tensors.size();
+
+            const size_t alignment = ggml_backend_get_alignment(wctx.backend);
+
+            for (const auto & t : tensor_offs) {
+                in_place = in_place && (uintptr_t) (mapping->addr + t.second) % alignment == 0;
+            }
+
+            if (in_place) {
+                model.buffer = ggml_backend_cpu_buffer_from_ptr(mapping->addr, mapping->size);
+
+                for (const auto & t : tensor_offs) {
+                    ggml_backend_tensor_alloc(model.buffer, t.first, mapping->addr + t.second);
+                }
+
+                if (wctx.params.use_mlock) {
+                    whisper_mmap_lock(*mapping);
+                }
+
+                WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB (mapped)\n", __func__, ggml_backend_name(wctx.backend), total_size / 1e6);
+            } else {
+                if (ggml_backend_is_cpu(wctx.backend) && model.n_loaded > 0) {
+                    WHISPER_LOG_WARN("%s: tensor data is not aligned to %zu bytes, copying the weights (see models/convert-ggml-to-aligned.py)\n", __func__, alignment);
+                }
+
+                model.buffer = ggml_backend_alloc_ctx_tensors(model.ctx, wctx.backend);
+                if (!model.buffer) {
+                    WHISPER_LOG_ERROR("%s: failed to allocate memory for the model\n", __func__);
+                    return false;
+                }
+
+                size_t size_main = ggml_backend_buffer_get_size(model.buffer);
+                WHISPER_LOG_INFO("%s: %8s total size = %8.2f MB\n", __func__, ggml_backend_name(wctx.backend), size_main / 1e6);
+
+                // copy straight from the page cache, without an intermediate read buffer
+                for (const auto & t : tensor_offs) {
+                    ggml_backend_tensor_set(t.first, mapping->addr + t.second, 0, ggml_nbytes(t.first));
+                }
+
+                // the mapping is not needed anymore
+                whisper_mmap_free(mapping);
+                model.mapping = nullptr;
+            }
+        }
+
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
 
         if (model.n_loaded == 0) {
@@ -1861,57 +2551,25 @@ static struct ggml_cgraph * whisper_build_graph_conv(
     return gf;
 }
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
+// the transformer blocks and the final norm of the encoder
+// inpL holds n_batch windows of n_ctx positional embeddings each: [n_state, n_ctx, n_batch]
+// note: the flash attention / flash FF paths support only n_batch == 1
+static struct ggml_tensor * whisper_build_encoder_blocks(
         whisper_context & wctx,
-          whisper_state & wstate) {
+           ggml_context * ctx0,
+            ggml_tensor * inpL,
+              const int   n_ctx,
+              const int   n_batch) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
-
     const float KQscale = 1.0f/sqrtf(float(n_state)/n_head);
 
-    // ===================================================================
-    // NOTE: experimenting with partial evaluation of the encoder (ignore)
-    //static int iter = -1;
-    //const int n_iter = 1500/n_ctx;
-
-    //iter = (iter + 1) % n_iter;
-
-    //if (iter == 0) {
-    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-    //}
-
-    static int iter = 0;
-
-    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
-
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
-
-    // ===================================================================
-
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
-
-    struct ggml_tensor * inpL = cur;
+    struct ggml_tensor * cur = nullptr;
 
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_encoder[il];
@@ -1981,14 +2639,14 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             // K * Q
@@ -2001,11 +2659,11 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
             struct ggml_tensor * V =
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
+                            ggml_reshape_4d(ctx0,
                                 Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                                n_state/n_head, n_head, n_ctx, n_batch),
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head, n_batch)
                         );
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -2014,7 +2672,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                    ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state, n_ctx, n_batch));
         }
 
         // projection
@@ -2082,6 +2740,56 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
+    return cur;
+}
+
+static struct ggml_cgraph * whisper_build_graph_encoder(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.alloc_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_encode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+
+    // ===================================================================
+    // NOTE: experimenting with partial evaluation of the encoder (ignore)
+    //static int iter = -1;
+    //const int n_iter = 1500/n_ctx;
+
+    //iter = (iter + 1) % n_iter;
+
+    //if (iter == 0) {
+    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+    //}
+
+    static int iter = 0;
+
+    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+
+    // ===================================================================
+
+    // original:
+    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+    cur = whisper_build_encoder_blocks(wctx, ctx0, cur, n_ctx, 1);
+
     ggml_build_forward_expand(gf, cur);
 
     wstate.embd_enc = cur;
@@ -2165,6 +2873,31 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// the compute threadpool of a backend, (re)created when more threads are requested
+static ggml_threadpool * whisper_threadpool_get(whisper_context & wctx, ggml_backend_t backend, ggml_threadpool * & threadpool, int n_threads) {
+    if (n_threads <= 1 || !ggml_backend_is_cpu(backend)) {
+        return nullptr;
+    }
+
+    if (threadpool && ggml_threadpool_n_threads(threadpool) >= n_threads) {
+        return threadpool;
+    }
+
+    ggml_threadpool_free(threadpool);
+
+    ggml_threadpool_params params = ggml_threadpool_default_params(n_threads);
+    params.n_spin   = wctx.params.threadpool_n_spin;
+    params.affinity = wctx.params.threadpool_affinity;
+
+    threadpool = ggml_threadpool_new(params);
+
+    return threadpool;
+}
+
+static ggml_threadpool * whisper_threadpool_get(whisper_context & wctx, whisper_state & wstate, int n_threads) {
+    return whisper_threadpool_get(wctx, wstate.backend, wstate.threadpool, n_threads);
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2223,7 +2956,7 @@ static bool whisper_encode_internal(
         }
 
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+            if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_threadpool_get(wctx, wstate, n_threads))) {
                 return false;
             }
         } else {
@@ -2246,7 +2979,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_threadpool_get(wctx, wstate, n_threads))) {
             return false;
         }
     }
@@ -2262,7 +2995,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_threadpool_get(wctx, wstate, n_threads))) {
             return false;
         }
     }
@@ -2273,160 +3006,561 @@ static bool whisper_encode_internal(
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-static struct ggml_cgraph * whisper_build_graph_decoder(
-         whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch,
-                    bool   save_alignment_heads_QKs,
-                    bool   worst_case) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
-
-    auto & kv_self = wstate.kv_self;
-
-    WHISPER_ASSERT(!!kv_self.ctx);
+template<typename T>
+static void whisper_batch_queue_join(whisper_batch_queue<T> & queue, int delta) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
 
-    const int n_ctx   = kv_self.size;
-    const int n_state = hparams.n_text_state;
-    const int n_head  = hparams.n_text_head;
-    const int n_layer = hparams.n_text_layer;
+    queue.n_active += delta;
+    queue.cv.notify_all();
+}
 
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+// counts a whisper_full_with_state() call as active on the queue while it is in scope
+// a call is a member only while it is in the phase that submits to the queue (encoding a window, or
+// decoding one), so the leader does not wait for calls that are busy with something else
+template<typename T>
+struct whisper_batch_queue_member {
+    whisper_batch_queue<T> * queue;
 
-    const int32_t n_kv     = worst_case ? n_ctx            : kv_self.n;
-    const int32_t kv_head  = worst_case ? n_ctx - n_tokens : kv_self.head;
+    explicit whisper_batch_queue_member(whisper_batch_queue<T> * queue) : queue(queue) {
+        if (queue) {
+            whisper_batch_queue_join(*queue, 1);
+        }
+    }
 
-    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+    ~whisper_batch_queue_member() {
+        if (queue) {
+            whisper_batch_queue_join(*queue, -1);
+        }
+    }
+};
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.alloc_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.alloc_decode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
+// queue a request and wait until it has been evaluated, possibly by the calling thread
+// T needs `done` and `ok` members, compat(a, b) tells if two requests can be evaluated together
+// and eval(requests) evaluates a batch, returning false on failure
+template<typename T, typename Compat, typename Eval>
+static bool whisper_batch_queue_submit(whisper_batch_queue<T> & queue, T & req, Compat compat, Eval eval) {
+    std::unique_lock<std::mutex> lock(queue.mutex);
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    req.done = false;
+    req.ok   = false;
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+    queue.pending.push_back(&req);
+    queue.cv.notify_all();
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(embd, "embd");
-    ggml_set_input(embd);
+    while (!req.done) {
+        if (queue.busy) {
+            queue.cv.wait(lock);
+            continue;
+        }
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(position, "position");
-    ggml_set_input(position);
+        // become the leader
+        queue.busy = true;
 
-    const float KQscale = pow(float(n_state)/n_head, -0.25);
+        auto n_ready = [&]() {
+            int n = 0;
+            for (const T * r : queue.pending) {
+                n += compat(req, *r);
+            }
+            return n;
+        };
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
-    ggml_set_name(KQ_mask, "KQ_mask");
-    ggml_set_input(KQ_mask);
+        const auto t_deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(queue.t_wait_us);
 
-    // token encoding + position encoding
-    struct ggml_tensor * cur =
-        ggml_add(ctx0,
-                ggml_get_rows(ctx0, model.d_te, embd),
-                ggml_get_rows(ctx0, model.d_pe, position));
+        while (n_ready() < std::min(queue.n_max, std::max(1, queue.n_active))) {
+            if (queue.cv.wait_until(lock, t_deadline) == std::cv_status::timeout) {
+                break;
+            }
+        }
 
-    struct ggml_tensor * inpL = cur;
+        std::vector<T *> reqs = { &req };
+        for (auto it = queue.pending.begin(); it != queue.pending.end(); ) {
+            if (*it == &req) {
+                it = queue.pending.erase(it);
+            } else if ((int) reqs.size() < queue.n_max && compat(req, **it)) {
+                reqs.push_back(*it);
+                it = queue.pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    struct ggml_tensor * aheads_cross_QKs = nullptr;
+        lock.unlock();
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_decoder[il];
+        const bool ok = eval(reqs);
 
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
+        lock.lock();
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
+        for (T * r : reqs) {
+            r->ok   = ok;
+            r->done = true;
         }
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.attn_q_w,
-                    cur);
+        queue.busy = false;
+        queue.cv.notify_all();
+    }
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.attn_q_b);
+    return req.ok;
+}
 
-            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+// conv + encoder + cross-attention memory of several windows in a single graph
+// the cross-attention memory of window i is written to kv_cross[i]
+// when kv_cross[i] is null, the memory is written to a scratch tensor (used for measuring the graph)
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+                        whisper_context & wctx,
+                  whisper_encoder_batch & batch,
+const std::vector<whisper_kv_cache *>   & kv_cross,
+                              const int   n_ctx) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
-                    layer.attn_k_w,
-                    cur);
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_mels  = hparams.n_mels;
+    const int n_batch = kv_cross.size();
 
-            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ batch.alloc.meta.size(),
+        /*.mem_buffer =*/ batch.alloc.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+    struct ggml_tensor * cur = nullptr;
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+    // convolution + gelu
+    // ggml_conv_1d does not handle batched input, so the im2col product is formed with the kernel on the left,
+    // which yields [n_state, n_ctx, n_batch] - the layout the encoder blocks expect, without a transpose
+    {
+        const auto & w1 = model.e_conv_1_w;
+        const auto & w2 = model.e_conv_2_w;
 
-            // ------
+        cur = ggml_im2col(ctx0, w1, mel, 1, 0, w1->ne[0]/2, 0, 1, 0, false, GGML_TYPE_F16);
+        cur = ggml_mul_mat(ctx0, ggml_reshape_2d(ctx0, w1, w1->ne[0]*w1->ne[1], w1->ne[2]), cur);
+        cur = ggml_add(ctx0, cur, ggml_reshape_1d(ctx0, model.e_conv_1_b, n_state));
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+        cur = ggml_gelu(ctx0, cur);
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state/n_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state/n_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+        // the second convolution reads [n_ctx, n_state, n_batch]
+        cur = ggml_cont(ctx0, ggml_transpose(ctx0, cur));
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+        cur = ggml_im2col(ctx0, w2, cur, 2, 0, w2->ne[0]/2, 0, 1, 0, false, GGML_TYPE_F16);
+        cur = ggml_mul_mat(ctx0, ggml_reshape_2d(ctx0, w2, w2->ne[0]*w2->ne[1], w2->ne[2]), cur);
+        cur = ggml_add(ctx0, cur, ggml_reshape_1d(ctx0, model.e_conv_2_b, n_state));
 
-            //struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+        cur = ggml_gelu(ctx0, cur);
+    }
 
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
-            struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ, KQ_mask);
+    {
+        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, 0);
+        cur = ggml_add(ctx0, cur, e_pe);
+    }
 
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_kv, n_state/n_head, n_head,
-                        n_ctx*ggml_element_size(kv_self.v),
-                        n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                        n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+    cur = whisper_build_encoder_blocks(wctx, ctx0, cur, n_ctx, n_batch);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+    // cross-attention memory
+    const float Kscale = pow(float(n_state) / n_head, -0.25);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+    for (int il = 0; il < hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
 
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                cur);
+
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
+
+        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_v_w,
+                cur);
+
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
+
+        for (int ib = 0; ib < n_batch; ++ib) {
+            struct ggml_tensor * Kb = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], ib*Kcross->nb[2]);
+            struct ggml_tensor * Vb = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*Vcross->nb[2]);
+
+            Vb = ggml_transpose(ctx0, Vb);
+
+            struct ggml_tensor * k = nullptr;
+            struct ggml_tensor * v = nullptr;
+
+            if (kv_cross[ib]) {
+                k = ggml_view_1d(ctx0, kv_cross[ib]->k,
+                        n_state*n_ctx,
+                        (ggml_element_size(kv_cross[ib]->k)*n_state)*(il*n_ctx));
+
+                v = ggml_view_2d(ctx0, kv_cross[ib]->v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross[ib]->v),
+                        (il*n_ctx)*ggml_element_size(kv_cross[ib]->v)*n_state);
+            } else {
+                k = ggml_new_tensor_1d(ctx0, wctx.itype, n_state*n_ctx);
+                v = ggml_new_tensor_2d(ctx0, wctx.itype, n_ctx, n_state);
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kb, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vb, v));
+        }
+    }
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// evaluate the given windows with one graph on the batch backend
+static bool whisper_encoder_batch_compute(
+                  whisper_encoder_batch & batch,
+const std::vector<whisper_encoder_batch::window *> & windows,
+                              const int   n_threads) {
+    whisper_context & wctx = *batch.ctx;
+
+    const int n_ctx   = windows[0]->n_ctx;
+    const int n_batch = windows.size();
+
+    std::vector<whisper_kv_cache *> kv_cross(n_batch);
+    for (int ib = 0; ib < n_batch; ++ib) {
+        kv_cross[ib] = &windows[ib]->state->kv_cross;
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(wctx, batch, kv_cross, n_ctx);
+
+    if (!ggml_gallocr_alloc_graph(batch.alloc.alloc, gf)) {
+        // should never happen as we pre-allocate the memory for the largest batch
+        return false;
+    }
+
+    // set the input
+    {
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        batch.inp_mel.resize(ggml_nelements(mel));
+
+        float * dst = batch.inp_mel.data();
+        memset(dst, 0, ggml_nbytes(mel));
+
+        for (int ib = 0; ib < n_batch; ++ib) {
+            const auto & mel_inp = windows[ib]->state->mel;
+
+            const int i0 = std::min(windows[ib]->mel_offset,           mel_inp.n_len);
+            const int i1 = std::min(windows[ib]->mel_offset + 2*n_ctx, mel_inp.n_len);
+
+            float * dst_b = dst + ib*2*n_ctx*mel_inp.n_mel;
+
+            for (int j = 0; j < mel_inp.n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst_b[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+                }
+            }
+        }
+
+        ggml_backend_tensor_set(mel, batch.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+    }
+
+    return ggml_graph_compute_helper(batch.backend, gf, n_threads, whisper_threadpool_get(wctx, batch.backend, batch.threadpool, n_threads));
+}
+
+// same as whisper_encode_internal, but the window may be evaluated together with windows of other states
+static bool whisper_encoder_batch_eval(
+  whisper_encoder_batch & batch,
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    if (batch.ctx != &wctx || whisper_encode_external(wstate)) {
+        return whisper_encode_internal(wctx, wstate, mel_offset, n_threads, abort_callback, abort_callback_data);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    whisper_encoder_batch::window win = {
+        /*.state      =*/ &wstate,
+        /*.mel_offset =*/ mel_offset,
+        /*.n_ctx      =*/ wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx,
+        /*.done       =*/ false,
+        /*.ok         =*/ false,
+    };
+
+    const bool ok = whisper_batch_queue_submit(batch.queue, win,
+            [](const whisper_encoder_batch::window & a, const whisper_encoder_batch::window & b) {
+                return a.n_ctx == b.n_ctx;
+            },
+            [&](const std::vector<whisper_encoder_batch::window *> & windows) {
+                return whisper_encoder_batch_compute(batch, windows, n_threads);
+            });
+
+    wstate.t_encode_us += ggml_time_us() - t_start_us;
+    wstate.n_encode++;
+
+    return ok && !(abort_callback && abort_callback(abort_callback_data));
+}
+
+// self-attention of the tokens in Qcur against the KV cache of one state
+// the keys and values of the tokens are first stored in the cache at kv_head
+static struct ggml_tensor * whisper_build_decoder_self_attn(
+        whisper_context & wctx,
+           ggml_context * ctx0,
+            ggml_cgraph * gf,
+       whisper_kv_cache & kv_self,
+            ggml_tensor * Qcur,
+            ggml_tensor * Kcur,
+            ggml_tensor * Vcur,
+            ggml_tensor * KQ_mask,
+              const int   il,
+              const int   n_kv,
+              const int   kv_head) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_ctx    = kv_self.size;
+    const int n_state  = hparams.n_text_state;
+    const int n_head   = hparams.n_text_head;
+    const int n_tokens = Qcur->ne[1];
+
+    // store key and value to memory
+    {
+        Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+
+        struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+        struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
+                (   n_ctx)*ggml_element_size(kv_self.v),
+                (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+    }
+
+    // ------
+
+    struct ggml_tensor * Q =
+        ggml_permute(ctx0,
+                ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
+                0, 2, 1, 3);
+
+    struct ggml_tensor * K =
+        ggml_view_3d(ctx0, kv_self.k,
+                n_state/n_head, n_kv, n_head,
+                ggml_element_size(kv_self.k)*n_state,
+                ggml_element_size(kv_self.k)*n_state/n_head,
+                ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+
+    // K * Q
+    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+    //struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, KQ_scale);
+
+    //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
+    struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ, KQ_mask);
+
+    struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+    struct ggml_tensor * V =
+        ggml_view_3d(ctx0, kv_self.v,
+                n_kv, n_state/n_head, n_head,
+                n_ctx*ggml_element_size(kv_self.v),
+                n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+
+    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+    return ggml_cpy(ctx0,
+            KQV_merged,
+            ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+}
+
+// cross-attention of the tokens in Qcur against the encoder output of one state
+// the attention weights are returned in KQ_soft_max_out (used for the DTW timestamps)
+static struct ggml_tensor * whisper_build_decoder_cross_attn(
+        whisper_context & wctx,
+           ggml_context * ctx0,
+       whisper_kv_cache & kv_cross,
+            ggml_tensor * Qcur,
+              const int   il,
+              const int   n_audio_ctx,
+           ggml_tensor ** KQ_soft_max_out) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_state  = hparams.n_text_state;
+    const int n_head   = hparams.n_text_head;
+    const int n_tokens = Qcur->ne[1];
+
+    // Kcross is already scaled
+    struct ggml_tensor * Kcross =
+        ggml_view_3d(ctx0, kv_cross.k,
+                n_state/n_head, n_audio_ctx, n_head,
+                ggml_element_size(kv_cross.k)*n_state,
+                ggml_element_size(kv_cross.k)*n_state/n_head,
+                ggml_element_size(kv_cross.k)*n_state*n_audio_ctx*il);
+
+    //struct ggml_tensor * Vcross =
+    //    ggml_reshape_3d(ctx0,
+    //            ggml_view_1d(ctx0, kv_cross.v, n_audio_ctx*n_state, il*n_audio_ctx*ggml_element_size(kv_cross.v)*n_state),
+    //            n_state/n_head, n_head, n_audio_ctx);
+
+    //struct ggml_tensor * V_trans =
+    //    ggml_cpy(ctx0,
+    //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
+    //            ggml_new_tensor_3d(ctx0, Vcross->type, n_audio_ctx, n_state/n_head, n_head));
+
+    struct ggml_tensor * V =
+        ggml_view_3d(ctx0, kv_cross.v,
+                n_audio_ctx, n_state/n_head, n_head,
+                n_audio_ctx*ggml_element_size(kv_cross.v),
+                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state/n_head,
+                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state*il);
+
+    // ------
+
+    struct ggml_tensor * Q =
+        ggml_permute(ctx0,
+                ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
+                0, 2, 1, 3);
+
+    // K * Q
+    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+
+    //struct ggml_tensor * KQ_scaled =
+    //    ggml_scale(ctx0,
+    //            KQ,
+    //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+    //            );
+
+    // no masking for cross-attention
+    //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+
+    struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+
+    if (KQ_soft_max_out) {
+        *KQ_soft_max_out = KQ_soft_max;
+    }
+
+    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+    // cur = KQV_merged.contiguous().view(n_state, n_tokens)
+    return ggml_cpy(ctx0,
+            KQV_merged,
+            ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
+}
+
+static struct ggml_cgraph * whisper_build_graph_decoder(
+         whisper_context & wctx,
+         whisper_state   & wstate,
+     const whisper_batch & batch,
+                    bool   save_alignment_heads_QKs,
+                    bool   worst_case) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    auto & kv_self = wstate.kv_self;
+
+    WHISPER_ASSERT(!!kv_self.ctx);
+
+    const int n_ctx   = kv_self.size;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    const int n_tokens    = batch.n_tokens;
+    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    const int32_t n_kv     = worst_case ? n_ctx            : kv_self.n;
+    const int32_t kv_head  = worst_case ? n_ctx - n_tokens : kv_self.head;
+
+    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.alloc_decode.meta.size(),
+        /*.mem_buffer =*/ wstate.alloc_decode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
+
+    const float KQscale = pow(float(n_state)/n_head, -0.25);
+
+    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
+    ggml_set_name(KQ_mask, "KQ_mask");
+    ggml_set_input(KQ_mask);
+
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
+
+    struct ggml_tensor * inpL = cur;
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    struct ggml_tensor * aheads_cross_QKs = nullptr;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.attn_q_b);
+
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
+
+            cur = whisper_build_decoder_self_attn(wctx, ctx0, gf, kv_self, Qcur, Kcur, Vcur, KQ_mask, il, n_kv, kv_head);
         }
 
         // projection
@@ -2467,51 +3601,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
             Qcur = ggml_scale(ctx0, Qcur, KQscale);
 
-            // Kcross is already scaled
-            struct ggml_tensor * Kcross =
-                ggml_view_3d(ctx0, wstate.kv_cross.k,
-                        n_state/n_head, n_audio_ctx, n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state,
-                        ggml_element_size(wstate.kv_cross.k)*n_state/n_head,
-                        ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
-
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, n_audio_ctx*n_state, il*n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, n_audio_ctx);
+            struct ggml_tensor * KQ_soft_max = nullptr;
 
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, n_audio_ctx, n_state/n_head, n_head));
-
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, wstate.kv_cross.v,
-                        n_audio_ctx, n_state/n_head, n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                        n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
-
-            // ------
-
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state/n_head, n_head, n_tokens),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
-
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
-
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+            cur = whisper_build_decoder_cross_attn(wctx, ctx0, wstate.kv_cross, Qcur, il, n_audio_ctx, &KQ_soft_max);
 
             // [EXPERIMENTAL] Token-level timestamps with DTW
             if (wctx.params.dtw_token_timestamps) {
@@ -2530,15 +3622,6 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                     }
                 }
             }
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_state, n_tokens)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens));
         }
 
         // projection
@@ -2626,11 +3709,312 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
         }
     }
 
-    ggml_build_forward_expand(gf, logits);
-
-    ggml_free(ctx0);
+    ggml_build_forward_expand(gf, logits);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// decoder steps of several states in a single graph
+// the KV cache slots of each step must already be prepared with whisper_decode_prepare()
+static struct ggml_cgraph * whisper_build_graph_decoder_batch(
+                        whisper_context & wctx,
+                  whisper_decoder_batch & dbatch,
+const std::vector<whisper_decoder_batch::step *> & steps) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+    const int n_steps = steps.size();
+
+    // offset of the first token of each step in the batch
+    std::vector<int> offs(n_steps + 1, 0);
+    for (int is = 0; is < n_steps; ++is) {
+        offs[is + 1] = offs[is] + steps[is]->batch->n_tokens;
+    }
+
+    const int n_tokens = offs[n_steps];
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ dbatch.alloc.meta.size(),
+        /*.mem_buffer =*/ dbatch.alloc.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, dbatch.n_nodes, false);
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
+
+    const float KQscale = pow(float(n_state)/n_head, -0.25);
+
+    std::vector<struct ggml_tensor *> KQ_mask(n_steps);
+    for (int is = 0; is < n_steps; ++is) {
+        KQ_mask[is] = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, steps[is]->state->kv_self.n, steps[is]->batch->n_tokens, 1);
+        ggml_format_name(KQ_mask[is], "KQ_mask_%d", is);
+        ggml_set_input(KQ_mask[is]);
+    }
+
+    // rows of the tokens of step is
+    auto step_rows = [&](struct ggml_tensor * t, int is) {
+        return ggml_view_2d(ctx0, t, t->ne[0], offs[is + 1] - offs[is], t->nb[1], offs[is]*t->nb[1]);
+    };
+
+    // stack the per-step outputs [n_state, n_tokens_i] back into [n_state, n_tokens]
+    auto merge_rows = [&](const std::vector<struct ggml_tensor *> & parts) {
+        struct ggml_tensor * res = nullptr;
+        for (auto * part : parts) {
+            part = ggml_reshape_3d(ctx0, part, n_state, 1, part->ne[1]);
+            res = res ? ggml_concat(ctx0, res, part) : part;
+        }
+        return ggml_reshape_2d(ctx0, res, n_state, n_tokens);
+    };
+
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
+
+    struct ggml_tensor * inpL = cur;
+
+    std::vector<struct ggml_tensor *> parts(n_steps);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.attn_q_b);
+
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
+
+            for (int is = 0; is < n_steps; ++is) {
+                auto & kv_self = steps[is]->state->kv_self;
+
+                parts[is] = whisper_build_decoder_self_attn(wctx, ctx0, gf, kv_self,
+                        step_rows(Qcur, is), step_rows(Kcur, is), step_rows(Vcur, is), KQ_mask[is], il, kv_self.n, kv_self.head);
+            }
+
+            cur = merge_rows(parts);
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.attn_ln_1_b);
+        }
+
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
+        }
+
+        // cross-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.cross_attn_q_b);
+
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+
+            for (int is = 0; is < n_steps; ++is) {
+                const auto & wstate = *steps[is]->state;
+
+                const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+                parts[is] = whisper_build_decoder_cross_attn(wctx, ctx0, steps[is]->state->kv_cross, step_rows(Qcur, is), il, n_audio_ctx, nullptr);
+            }
+
+            cur = merge_rows(parts);
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.cross_attn_ln_1_b);
+        }
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
+
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_0_b);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_1_b);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, hparams.eps);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    cur,
+                    model.d_ln_w),
+                model.d_ln_b);
+    }
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+
+    ggml_build_forward_expand(gf, logits);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// find a KV cache slot for the batch and build its self-attention mask in wstate.inp_mask
+static bool whisper_decode_prepare(whisper_state & wstate, const whisper_batch & batch) {
+    auto & kv_self = wstate.kv_self;
+
+    if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+        return false;
+    }
+
+    kv_self.n = whisper_kv_cache_cell_max(kv_self);
+    //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
+    //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
+
+    const int32_t n_kv     = kv_self.n;
+    const int32_t n_tokens = batch.n_tokens;
+
+    wstate.inp_mask.resize(n_kv*n_tokens);
+
+    float * data = wstate.inp_mask.data();
+    memset(data, 0, n_kv*n_tokens*sizeof(float));
+
+    for (int h = 0; h < 1; ++h) {
+        for (int j = 0; j < n_tokens; ++j) {
+            const whisper_pos    pos    = batch.pos[j];
+            const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+            for (int i = 0; i < n_kv; ++i) {
+                if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+                }
+            }
+        }
+    }
+
+    return true;
+}
 
-    return gf;
+static void whisper_decode_update_timings(whisper_state & wstate, int n_tokens, int64_t t_start_us) {
+    if (n_tokens == 1) {
+        wstate.t_decode_us += ggml_time_us() - t_start_us;
+        wstate.n_decode++;
+    } else if (n_tokens < 16) {
+        wstate.t_batchd_us += ggml_time_us() - t_start_us;
+        wstate.n_batchd += n_tokens;
+    } else {
+        wstate.t_prompt_us += ggml_time_us() - t_start_us;
+        wstate.n_prompt += n_tokens;
+    }
 }
 
 // evaluate the decoder
@@ -2663,17 +4047,8 @@ static bool whisper_decode_internal(
 
     struct ggml_tensor * logits;
 
-    // find KV slot for the batch
-    {
-        auto & kv_self = wstate.kv_self;
-
-        if (!whisper_kv_cache_find_slot(kv_self, batch)) {
-            return false;
-        }
-
-        kv_self.n = whisper_kv_cache_cell_max(kv_self);
-        //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
-        //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
+    if (!whisper_decode_prepare(wstate, batch)) {
+        return false;
     }
 
     // decoder
@@ -2703,34 +4078,12 @@ static bool whisper_decode_internal(
 
         {
             struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
-
-            auto & kv_self = wstate.kv_self;
-            const int32_t n_kv     = kv_self.n;
-
-            wstate.inp_mask.resize(n_kv*n_tokens);
-
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
-
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
-
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
-            }
-
             ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
         }
 
         logits = gf->nodes[gf->n_nodes - 1];
 
-        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(wstate.backend, gf, n_threads, whisper_threadpool_get(wctx, wstate, n_threads))) {
             return false;
         }
     }
@@ -2752,20 +4105,121 @@ static bool whisper_decode_internal(
         //        wstate.get_buf_max_mem(3)/1e6);
     }
 
-    if (batch.n_tokens == 1) {
-        wstate.t_decode_us += ggml_time_us() - t_start_us;
-        wstate.n_decode++;
-    } else if (batch.n_tokens < 16) {
-        wstate.t_batchd_us += ggml_time_us() - t_start_us;
-        wstate.n_batchd += n_tokens;
-    } else {
-        wstate.t_prompt_us += ggml_time_us() - t_start_us;
-        wstate.n_prompt += n_tokens;
-    }
+    whisper_decode_update_timings(wstate, n_tokens, t_start_us);
 
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
+// evaluate the given decoder steps with one graph on the batch backend
+static bool whisper_decoder_batch_compute(
+                  whisper_decoder_batch & dbatch,
+const std::vector<whisper_decoder_batch::step *> & steps,
+                              const int   n_threads) {
+    whisper_context & wctx = *dbatch.ctx;
+
+    const int n_vocab = wctx.model.hparams.n_vocab;
+    const int n_steps = steps.size();
+
+    ggml_cgraph * gf = whisper_build_graph_decoder_batch(wctx, dbatch, steps);
+
+    // the compute buffer grows with the number and length of the steps
+    if (!ggml_gallocr_alloc_graph(dbatch.alloc.alloc, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return false;
+    }
+
+    // set the inputs
+    {
+        dbatch.inp_embd.clear();
+        dbatch.inp_pos.clear();
+
+        for (const auto * st : steps) {
+            dbatch.inp_embd.insert(dbatch.inp_embd.end(), st->batch->token, st->batch->token + st->batch->n_tokens);
+            dbatch.inp_pos .insert(dbatch.inp_pos .end(), st->batch->pos,   st->batch->pos   + st->batch->n_tokens);
+        }
+
+        struct ggml_tensor * embd     = ggml_graph_get_tensor(gf, "embd");
+        struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
+
+        ggml_backend_tensor_set(embd,     dbatch.inp_embd.data(), 0, ggml_nbytes(embd));
+        ggml_backend_tensor_set(position, dbatch.inp_pos.data(),  0, ggml_nbytes(position));
+    }
+
+    for (int is = 0; is < n_steps; ++is) {
+        char name[32];
+        snprintf(name, sizeof(name), "KQ_mask_%d", is);
+
+        struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, name);
+        ggml_backend_tensor_set(KQ_mask, steps[is]->state->inp_mask.data(), 0, ggml_nbytes(KQ_mask));
+    }
+
+    struct ggml_tensor * logits = gf->nodes[gf->n_nodes - 1];
+
+    if (!ggml_graph_compute_helper(dbatch.backend, gf, n_threads, whisper_threadpool_get(wctx, dbatch.backend, dbatch.threadpool, n_threads))) {
+        return false;
+    }
+
+    int i0 = 0;
+    for (const auto * st : steps) {
+        const auto & batch = *st->batch;
+
+        auto & logits_out = st->state->logits;
+
+        logits_out.resize(batch.n_tokens*n_vocab);
+        for (int i = 0; i < batch.n_tokens; i++) {
+            if (batch.logits[i] == 0) {
+                continue;
+            }
+            ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*(i0 + i)), sizeof(float)*n_vocab);
+        }
+
+        i0 += batch.n_tokens;
+    }
+
+    return true;
+}
+
+// same as whisper_decode_internal, but the step may be evaluated together with the steps of other states
+// prompts, DTW timestamps and steps of other contexts are evaluated on their own
+static bool whisper_decoder_batch_eval(
+  whisper_decoder_batch & dbatch,
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const whisper_batch & batch,
+              const int   n_threads,
+                   bool   save_alignment_heads_QKs,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    if (dbatch.ctx != &wctx || wctx.params.dtw_token_timestamps || save_alignment_heads_QKs || batch.n_tokens > WHISPER_MAX_DECODERS) {
+        return whisper_decode_internal(wctx, wstate, batch, n_threads, save_alignment_heads_QKs, abort_callback, abort_callback_data);
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_decode_prepare(wstate, batch)) {
+        return false;
+    }
+
+    whisper_decoder_batch::step st = {
+        /*.state =*/ &wstate,
+        /*.batch =*/ &batch,
+        /*.done  =*/ false,
+        /*.ok    =*/ false,
+    };
+
+    const bool ok = whisper_batch_queue_submit(dbatch.queue, st,
+            [](const whisper_decoder_batch::step &, const whisper_decoder_batch::step &) {
+                return true;
+            },
+            [&](const std::vector<whisper_decoder_batch::step *> & steps) {
+                return whisper_decoder_batch_compute(dbatch, steps, n_threads);
+            });
+
+    whisper_decode_update_timings(wstate, batch.n_tokens, t_start_us);
+
+    return ok && !(abort_callback && abort_callback(abort_callback_data));
+}
+
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
 static std::string to_timestamp(int64_t t, bool comma = false) {
@@ -2783,101 +4237,237 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
     return std::string(buf);
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-static float sin_vals[SIN_COS_N_COUNT];
-static float cos_vals[SIN_COS_N_COUNT];
+// In FFT, we frequently use the same twiddle factors and index permutations.
+// They are computed once per transform size and kept in the plan (see whisper_fft_plan).
+static bool whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    if (n < 2 || n % 2 != 0) {
+        return false;
+    }
+
+    // the real input of size n is transformed as a complex sequence of size n/2
+    const int m = n/2;
 
-// In FFT, we frequently use sine and cosine operations with the same values.
-// We can use precalculated values to speed up the process.
-static void fill_sin_cos_table() {
-    static bool is_filled = false;
-    if (is_filled) return;
-    for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-        double theta = (2*M_PI*i)/SIN_COS_N_COUNT;
-        sin_vals[i] = sinf(theta);
-        cos_vals[i] = cosf(theta);
+    std::vector<int> factors;
+    {
+        int r = m;
+        while (r % 4 == 0) { factors.push_back(4); r /= 4; }
+        while (r % 2 == 0) { factors.push_back(2); r /= 2; }
+        for (int p = 3; r > 1; p += 2) {
+            while (r % p == 0) {
+                if (p > WHISPER_FFT_MAX_RADIX) {
+                    return false;
+                }
+                factors.push_back(p);
+                r /= p;
+            }
+        }
+    }
+
+    plan.n = n;
+
+    // digit-reversal permutation: input i = r0 + f0*(r1 + f1*(r2 + ...)) goes to r0*(m/f0) + r1*(m/(f0*f1)) + ...
+    plan.perm.resize(m);
+    for (int i = 0; i < m; i++) {
+        int q   = i;
+        int pos = 0;
+        int len = m;
+        for (int f : factors) {
+            len /= f;
+            pos += (q % f)*len;
+            q   /= f;
+        }
+        plan.perm[pos] = i;
     }
-    is_filled = true;
-}
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+    // the stages are applied from the innermost factor outwards
+    plan.stages.clear();
+    plan.twiddles.clear();
+    plan.roots.clear();
 
-    out.resize(N*2);
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+    int L = 1;
+    for (int s = (int) factors.size() - 1; s >= 0; s--) {
+        const int p = factors[s];
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+        whisper_fft_plan::stage st;
+        st.p        = p;
+        st.L        = L;
+        st.tw_off   = plan.twiddles.size();
+        st.root_off = plan.roots.size();
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*cos_vals[idx]; // cos(t)
-            im -= in[n]*sin_vals[idx]; // sin(t)
+        // W_{p*L}^{r*k}, stored as [k][r - 1]
+        for (int k = 0; k < L; k++) {
+            for (int r = 1; r < p; r++) {
+                const double theta = (2*M_PI*r*k)/(p*L);
+                plan.twiddles.push_back( cos(theta));
+                plan.twiddles.push_back(-sin(theta));
+            }
         }
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+        // W_p^j, used by the generic butterfly
+        for (int j = 0; j < p; j++) {
+            const double theta = (2*M_PI*j)/p;
+            plan.roots.push_back( cos(theta));
+            plan.roots.push_back(-sin(theta));
+        }
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+        plan.stages.push_back(st);
 
-    int N = in.size();
+        L *= p;
+    }
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+    // W_n^k, k = 0 .. n/2, used to split the packed transform into the spectrum of the real input
+    plan.split.resize(2*(m + 1));
+    for (int k = 0; k <= m; k++) {
+        const double theta = (2*M_PI*k)/n;
+        plan.split[2*k + 0] =  cos(theta);
+        plan.split[2*k + 1] = -sin(theta);
     }
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+    return true;
+}
+
+// mixed-radix decimation-in-time FFT of a real input, in place and without allocations
+// in holds plan.n real values, out receives plan.n/2 + 1 complex bins (plan.n + 2 floats)
+static void whisper_fft(const whisper_fft_plan & plan, const float * in, float * out) {
+    const int m = plan.n/2;
+
+    // pack even/odd samples as the real/imaginary parts of m complex values, in digit-reversed order
+    for (int i = 0; i < m; i++) {
+        const int src = plan.perm[i];
+        out[2*i + 0] = in[2*src + 0];
+        out[2*i + 1] = in[2*src + 1];
     }
 
-    std::vector<float> even;
-    std::vector<float> odd;
+    for (const auto & st : plan.stages) {
+        const int p  = st.p;
+        const int L  = st.L;
+        const int pL = p*L;
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+        const float * tw = plan.twiddles.data() + st.tw_off;
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
+        for (int base = 0; base < m; base += pL) {
+            float * x = out + 2*base;
+
+            switch (p) {
+                case 2:
+                    {
+                        for (int k = 0; k < L; k++) {
+                            float * x0 = x + 2*k;
+                            float * x1 = x0 + 2*L;
+
+                            const float wr = tw[2*k + 0];
+                            const float wi = tw[2*k + 1];
+
+                            const float br = x1[0]*wr - x1[1]*wi;
+                            const float bi = x1[0]*wi + x1[1]*wr;
+
+                            x1[0] = x0[0] - br;
+                            x1[1] = x0[1] - bi;
+                            x0[0] = x0[0] + br;
+                            x0[1] = x0[1] + bi;
+                        }
+                    } break;
+                case 4:
+                    {
+                        for (int k = 0; k < L; k++) {
+                            float * x0 = x + 2*k;
+                            float * x1 = x0 + 2*L;
+                            float * x2 = x1 + 2*L;
+                            float * x3 = x2 + 2*L;
+
+                            const float * w = tw + 6*k;
+
+                            const float a1r = x1[0]*w[0] - x1[1]*w[1];
+                            const float a1i = x1[0]*w[1] + x1[1]*w[0];
+                            const float a2r = x2[0]*w[2] - x2[1]*w[3];
+                            const float a2i = x2[0]*w[3] + x2[1]*w[2];
+                            const float a3r = x3[0]*w[4] - x3[1]*w[5];
+                            const float a3i = x3[0]*w[5] + x3[1]*w[4];
+
+                            const float t0r = x0[0] + a2r, t0i = x0[1] + a2i;
+                            const float t1r = x0[0] - a2r, t1i = x0[1] - a2i;
+                            const float t2r = a1r + a3r,   t2i = a1i + a3i;
+                            const float t3r = a1r - a3r,   t3i = a1i - a3i;
+
+                            x0[0] = t0r + t2r; x0[1] = t0i + t2i;
+                            x2[0] = t0r - t2r; x2[1] = t0i - t2i;
+                            x1[0] = t1r + t3i; x1[1] = t1i - t3r;
+                            x3[0] = t1r - t3i; x3[1] = t1i + t3r;
+                        }
+                    } break;
+                default:
+                    {
+                        const float * roots = plan.roots.data() + st.root_off;
+
+                        float a[2*WHISPER_FFT_MAX_RADIX];
+
+                        for (int k = 0; k < L; k++) {
+                            const float * w = tw + 2*(p - 1)*k;
+
+                            a[0] = x[2*k + 0];
+                            a[1] = x[2*k + 1];
+                            for (int r = 1; r < p; r++) {
+                                const float * xr = x + 2*(r*L + k);
+                                a[2*r + 0] = xr[0]*w[2*(r - 1) + 0] - xr[1]*w[2*(r - 1) + 1];
+                                a[2*r + 1] = xr[0]*w[2*(r - 1) + 1] + xr[1]*w[2*(r - 1) + 0];
+                            }
+
+                            for (int q = 0; q < p; q++) {
+                                float re = a[0];
+                                float im = a[1];
+                                int j = 0;
+                                for (int r = 1; r < p; r++) {
+                                    j += q;
+                                    if (j >= p) {
+                                        j -= p;
+                                    }
+                                    re += a[2*r + 0]*roots[2*j + 0] - a[2*r + 1]*roots[2*j + 1];
+                                    im += a[2*r + 0]*roots[2*j + 1] + a[2*r + 1]*roots[2*j + 0];
+                                }
+                                x[2*(q*L + k) + 0] = re;
+                                x[2*(q*L + k) + 1] = im;
+                            }
+                        }
+                    } break;
+            }
         }
     }
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+    // X[k] = (A + conj(B))/2 - i/2*W_n^k*(A - conj(B)), A = Z[k], B = Z[m - k]
+    // each pair (k, m - k) reads and writes the same two slots
+    for (int k = 0; k <= m/2; k++) {
+        const int km = (m - k) % m;
+
+        const float ar = out[2*k  + 0];
+        const float ai = out[2*k  + 1];
+        const float br = out[2*km + 0];
+        const float bi = out[2*km + 1];
+
+        {
+            const float wr = plan.split[2*k + 0];
+            const float wi = plan.split[2*k + 1];
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+            const float dr = ar - br;
+            const float di = ai + bi;
+            const float cr = wr*dr - wi*di;
+            const float ci = wr*di + wi*dr;
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < N/2; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = cos_vals[idx]; // cos(t)
-        float im = -sin_vals[idx]; // sin(t)
+            out[2*k + 0] = 0.5f*(ar + br + ci);
+            out[2*k + 1] = 0.5f*(ai - bi - cr);
+        }
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        if (k != m - k) {
+            const float wr = plan.split[2*(m - k) + 0];
+            const float wi = plan.split[2*(m - k) + 1];
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+            const float dr = br - ar;
+            const float di = bi + ai;
+            const float cr = wr*dr - wi*di;
+            const float ci = wr*di + wi*dr;
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+            out[2*(m - k) + 0] = 0.5f*(br + ar + ci);
+            out[2*(m - k) + 1] = 0.5f*(bi - ai - cr);
+        }
     }
 }
 
@@ -2896,73 +4486,104 @@ static bool hann_window(int length, bool periodic, std::vector<float> & output)
     return true;
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size, 0.0);
-    std::vector<float> fft_out(2 * frame_size);
-    int n_fft = filters.n_fft;
-    int i = ith;
+// the lowest value of a raw log10 mel column: log10 of the power floor
+#define WHISPER_LOG_MEL_MIN -10.0f
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert( n_fft == 1 + (frame_size / 2) );
-    
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+// dot product with independent accumulators so the compiler can vectorize it
+static float whisper_vec_dot_f32(const float * x, const float * y, int n) {
+    float s0 = 0.0f;
+    float s1 = 0.0f;
+    float s2 = 0.0f;
+    float s3 = 0.0f;
 
-        // apply Hanning window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+    int i = 0;
+    for (; i + 3 < n; i += 4) {
+        s0 += x[i + 0]*y[i + 0];
+        s1 += x[i + 1]*y[i + 1];
+        s2 += x[i + 2]*y[i + 2];
+        s3 += x[i + 3]*y[i + 3];
+    }
+    for (; i < n; i++) {
+        s0 += x[i]*y[i];
+    }
 
-        // FFT
-        fft(fft_in, fft_out);
+    return (s0 + s1) + (s2 + s3);
+}
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+// compute a single raw (un-normalized) log10 mel column and return its maximum
+// the first n_valid samples of the frame are used, the rest of the window is treated as zeros
+static float log_mel_column(const float * frame, int n_valid, const std::vector<float> & hann, int frame_size,
+                            const whisper_filters & filters, const whisper_fft_plan & plan,
+                            std::vector<float> & fft_in, std::vector<float> & fft_out, float * out, int stride) {
+    n_valid = std::min(frame_size, n_valid);
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
+    // apply Hanning window (~10% faster)
+    for (int j = 0; j < n_valid; j++) {
+        fft_in[j] = hann[j] * frame[j];
+    }
+    // fill the rest with zeros
+    if (n_valid < frame_size) {
+        std::fill(fft_in.begin() + n_valid, fft_in.end(), 0.0);
+    }
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+    // FFT
+    whisper_fft(plan, fft_in.data(), fft_out.data());
 
-            sum = log10(std::max(sum, 1e-10));
+    // Calculate modulus^2 of complex numbers
+    // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+    for (int j = 0; j < filters.n_fft; j++) {
+        fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    }
 
-            mel.data[j * mel.n_len + i] = sum;
-        }
+    // mel spectrogram: project onto the non-zero part of each filter, then floor, log10 and track the maximum
+    float cmax = WHISPER_LOG_MEL_MIN;
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float sum = whisper_vec_dot_f32(fft_out.data() + filters.sparse_start[j], filters.sparse_data.data() + filters.sparse_offs[j], filters.sparse_len[j]);
+        const float val = log10f(std::max(sum, 1e-10f));
+
+        out[j * stride] = val;
+        cmax = std::max(cmax, val);
+    }
+
+    return cmax;
+}
+
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & hann, const float * samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, const whisper_fft_plan & plan,
+                                              std::vector<float> & fft_in, std::vector<float> & fft_out, whisper_mel & mel, float & mmax) {
+    int i = ith;
+
+    mmax = WHISPER_LOG_MEL_MIN;
+
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    assert( filters.n_fft == 1 + (frame_size / 2) );
+
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
+
+        mmax = std::max(mmax, log_mel_column(samples + offset, n_samples - offset, hann, frame_size, filters, plan, fft_in, fft_out, mel.data.data() + i, mel.n_len));
     }
 
     // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
     for (; i < mel.n_len; i += n_threads) {
         for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
+            mel.data[j * mel.n_len + i] = WHISPER_LOG_MEL_MIN;
         }
     }
 }
 
+// clamp to (mmax - 8) and scale, in place
+// mmax is the maximum of the raw values, tracked while the columns are computed
+static void log_mel_normalize(whisper_mel & mel, float mmax) {
+    mmax -= 8.0f;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        mel.data[i] = (std::max(mel.data[i], mmax) + 4.0f)/4.0f;
+    }
+}
+
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
 static bool log_mel_spectrogram(
               whisper_state & wstate,
@@ -2974,6 +4595,7 @@ static bool log_mel_spectrogram(
               const int   n_mel,
               const int   n_threads,
               const whisper_filters & filters,
+              const whisper_fft_plan & plan,
               const bool   debug,
               whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
@@ -2981,7 +4603,7 @@ static bool log_mel_spectrogram(
     // Hanning window (Use cosf to eliminate difference)
     // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    std::vector<float> hann;
+    std::vector<float> & hann = wstate.mel_hann;
     hann_window(frame_size, true, hann);
 
 
@@ -2989,13 +4611,14 @@ static bool log_mel_spectrogram(
     int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
     int64_t stage_2_pad = frame_size / 2;
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    // Copy the samples into the reusable padded buffer.
+    // The 30 seconds of zeros at the end are not materialized - the frames that fall there are constant.
+    std::vector<float> & samples_padded = wstate.mel_pcm;
+    samples_padded.resize(n_samples + stage_2_pad * 2);
     std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+    // zero pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.end(), 0);
 
     // reflective pad 200 samples at the beginning of audio
     std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
@@ -3003,47 +4626,35 @@ static bool log_mel_spectrogram(
     mel.n_mel     = n_mel;
     // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
     // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    mel.n_len     = (n_samples + stage_1_pad + stage_2_pad * 2 - frame_size) / frame_step;
     // Calculate semi-padded sample length to ensure compatibility
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
-
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples_padded,
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
-
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
+    // per-thread FFT scratch
+    if ((int) wstate.mel_fft_in.size() < n_threads) {
+        wstate.mel_fft_in.resize(n_threads);
+        wstate.mel_fft_out.resize(n_threads);
     }
-
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
+    for (int ith = 0; ith < n_threads; ++ith) {
+        wstate.mel_fft_in[ith].resize(frame_size);
+        wstate.mel_fft_out[ith].resize(2 * frame_size);
     }
 
-    mmax -= 8.0;
+    std::vector<float> mmax(n_threads, WHISPER_LOG_MEL_MIN);
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+    {
+        const float * samples_data = samples_padded.data();
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        whisper_worker_pool_run(wstate.workers, n_threads, [&](int ith) {
+            log_mel_spectrogram_worker_thread(ith, hann, samples_data, n_samples + stage_2_pad, frame_size, frame_step, n_threads,
+                    filters, plan, wstate.mel_fft_in[ith], wstate.mel_fft_out[ith], mel, mmax[ith]);
+        });
     }
 
+    // clamping and normalization
+    log_mel_normalize(mel, *std::max_element(mmax.begin(), mmax.end()));
+
     wstate.t_mel_us += ggml_time_us() - t_start_us;
 
     // Dump log_mel_spectrogram
@@ -3060,6 +4671,118 @@ static bool log_mel_spectrogram(
     return true;
 }
 
+static void log_mel_stream_reset(whisper_mel_stream & stream, const whisper_filters & filters, int frame_size, int len_ms) {
+    stream.n_mel    = filters.n_mel;
+    stream.n_ring   = std::max(1, len_ms/10 + 1); // 100 columns per second
+    stream.n_pushed = 0;
+    stream.n_frames = 0;
+
+    // left padding of the first frames
+    stream.pcm_off = -frame_size/2;
+    stream.pcm.assign(frame_size/2, 0.0f);
+
+    stream.ring.assign((size_t) stream.n_ring*stream.n_mel, 0.0f);
+
+    hann_window(frame_size, true, stream.hann);
+    stream.fft_in.assign(frame_size, 0.0f);
+    stream.fft_out.assign(2*frame_size, 0.0f);
+}
+
+// append samples and transform only the frames that became complete
+static void log_mel_stream_push(
+         whisper_mel_stream & stream,
+            const float * samples,
+                    int   n_samples,
+                    int   frame_size,
+                    int   frame_step,
+  const whisper_filters & filters,
+ const whisper_fft_plan & plan) {
+    stream.pcm.insert(stream.pcm.end(), samples, samples + n_samples);
+    stream.n_pushed += n_samples;
+
+    while (stream.n_frames*frame_step + frame_size/2 <= stream.n_pushed) {
+        const int64_t offset = stream.n_frames*frame_step - frame_size/2 - stream.pcm_off;
+
+        float * col = stream.ring.data() + (stream.n_frames % stream.n_ring)*stream.n_mel;
+
+        log_mel_column(stream.pcm.data() + offset, frame_size, stream.hann, frame_size, filters, plan, stream.fft_in, stream.fft_out, col, 1);
+
+        stream.n_frames++;
+    }
+
+    // drop the samples that are not needed by any incomplete frame
+    const int64_t pcm_keep = stream.n_frames*frame_step - frame_size/2;
+    if (pcm_keep > stream.pcm_off) {
+        stream.pcm.erase(stream.pcm.begin(), stream.pcm.begin() + (pcm_keep - stream.pcm_off));
+        stream.pcm_off = pcm_keep;
+    }
+}
+
+// build the spectrogram of the last n_samples pushed samples
+// the window start is rounded up to the frame grid, the complete frames are taken from the ring
+// and only the frames overlapping the end of the audio are transformed here
+// unlike log_mel_spectrogram(), the first columns see the earlier audio instead of a reflective pad
+static bool log_mel_stream_window(
+         whisper_mel_stream & stream,
+                    int   n_samples,
+                    int   frame_size,
+                    int   frame_step,
+  const whisper_filters & filters,
+ const whisper_fft_plan & plan,
+            whisper_mel & mel) {
+    if (stream.n_mel == 0) {
+        WHISPER_LOG_ERROR("%s: stream is not initialized\n", __func__);
+        return false;
+    }
+
+    n_samples = (int) std::min<int64_t>(n_samples, stream.n_pushed);
+
+    int64_t f0 = (stream.n_pushed - n_samples + frame_step - 1)/frame_step;
+    if (f0 < stream.n_frames - stream.n_ring) {
+        WHISPER_LOG_WARN("%s: window of %d samples exceeds the stream length, truncating\n", __func__, n_samples);
+        f0 = stream.n_frames - stream.n_ring;
+    }
+
+    const int64_t n_window = stream.n_pushed - f0*frame_step;
+
+    mel.n_mel     = stream.n_mel;
+    mel.n_len     = (n_window + WHISPER_SAMPLE_RATE*30)/frame_step;
+    mel.n_len_org = 1 + (n_window + frame_size/2 - frame_size)/frame_step;
+    mel.data.resize(mel.n_mel*mel.n_len);
+
+    int i = 0;
+    int64_t f = f0;
+
+    float mmax = WHISPER_LOG_MEL_MIN;
+
+    for (; f < stream.n_frames && i < mel.n_len; ++f, ++i) {
+        const float * col = stream.ring.data() + (f % stream.n_ring)*stream.n_mel;
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j*mel.n_len + i] = col[j];
+            mmax = std::max(mmax, col[j]);
+        }
+    }
+
+    for (; i < mel.n_len; ++f, ++i) {
+        const int64_t start = f*frame_step - frame_size/2;
+        if (start >= stream.n_pushed) {
+            break;
+        }
+
+        mmax = std::max(mmax, log_mel_column(stream.pcm.data() + (start - stream.pcm_off), stream.n_pushed - start, stream.hann, frame_size, filters, plan,
+                stream.fft_in, stream.fft_out, mel.data.data() + i, mel.n_len));
+    }
+
+    // the remaining frames see only the zero padding
+    for (int j = 0; j < mel.n_mel; j++) {
+        std::fill(mel.data.begin() + j*mel.n_len + i, mel.data.begin() + (j + 1)*mel.n_len, WHISPER_LOG_MEL_MIN);
+    }
+
+    log_mel_normalize(mel, mmax);
+
+    return true;
+}
+
 // split text into tokens
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
@@ -3070,51 +4793,87 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
-
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+// character classes of the pre-tokenizer, same as the "C" locale
+static bool whisper_tok_is_space(uint8_t c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static bool whisper_tok_is_alpha(uint8_t c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static bool whisper_tok_is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+static bool whisper_tok_is_other(uint8_t c) { return !whisper_tok_is_space(c) && !whisper_tok_is_alpha(c) && !whisper_tok_is_digit(c); }
+
+// length of the word at the start of [s, s + n), n > 0
+// hand-written matcher of the GPT-2 pre-tokenizer pattern, with the same alternatives in the same order:
+//   's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+static size_t whisper_tok_word_len(const uint8_t * s, size_t n) {
+    if (s[0] == '\'' && n > 1) {
+        static const char * contractions[] = { "s", "t", "re", "ve", "m", "ll", "d" };
+        for (const char * suffix : contractions) {
+            const size_t len = strlen(suffix);
+            if (n > len && memcmp(s + 1, suffix, len) == 0) {
+                return 1 + len;
+            }
+        }
+    }
 
-        std::regex re(pat);
-        std::smatch m;
+    // ` ?` followed by a run of one class
+    for (auto is_class : { whisper_tok_is_alpha, whisper_tok_is_digit, whisper_tok_is_other }) {
+        const size_t i0 = (s[0] == ' ' && n > 1 && is_class(s[1])) ? 1 : 0;
+        if (!is_class(s[i0])) {
+            continue;
+        }
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+        size_t i = i0 + 1;
+        while (i < n && is_class(s[i])) {
+            i++;
         }
+        return i;
+    }
+
+    // only whitespace is left - leave the last space of the run to the word that follows it
+    size_t i = 1;
+    while (i < n && whisper_tok_is_space(s[i])) {
+        i++;
     }
+    return (i < n && i > 1) ? i - 1 : i;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    const auto & trie = vocab.trie;
+
+    const uint8_t * s = (const uint8_t *) text.data();
+    const size_t    n = text.size();
 
-    // find the longest tokens that form the words:
     std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
+
+    // split the text into words and find the longest tokens that form them
+    for (size_t w0 = 0; w0 < n; ) {
+        const size_t w1 = w0 + whisper_tok_word_len(s + w0, n - w0);
+
+        size_t i = w0;
+        while (i < w1) {
+            whisper_vocab::id id = -1;
+            size_t j_best = i;
+
+            int32_t node = 0;
+            for (size_t j = i; j < w1; ++j) {
+                node = trie.next(node, s[j]);
+                if (node < 0) {
                     break;
                 }
-                --j;
+                if (trie.nodes[node].id >= 0) {
+                    id     = trie.nodes[node].id;
+                    j_best = j + 1;
+                }
             }
-            if (!found) {
+
+            if (id >= 0) {
+                tokens.push_back(id);
+                i = j_best;
+            } else {
                 WHISPER_LOG_ERROR("unknown token\n");
                 ++i;
             }
         }
+
+        w0 = w1;
     }
 
     return tokens;
@@ -3173,8 +4932,6 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 #endif
 
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    fill_sin_cos_table();
-
     whisper_state * state = new whisper_state;
 
     state->backend = whisper_backend_init(ctx->params);
@@ -3246,9 +5003,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     // TAGS: WHISPER_DECODER_INIT
     state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
 
-    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
     state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
     state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
 
     state->decoders[0].rng = std::mt19937(0);
@@ -3328,13 +5083,15 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     return state;
 }
 
-int whisper_ctx_init_openvino_encoder(
+int whisper_ctx_init_openvino_encoder_with_state(
         struct whisper_context * ctx,
+          struct whisper_state * state,
                     const char * model_path,
                     const char * device,
                     const char * cache_dir) {
 #ifndef WHISPER_USE_OPENVINO
     (void)(ctx);
+    (void)(state);
     (void)(model_path);
     (void)(device);
     (void)(cache_dir);
@@ -3365,8 +5122,8 @@ int whisper_ctx_init_openvino_encoder(
     WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
     WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
 
-    ctx->state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!ctx->state->ctx_openvino) {
+    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!state->ctx_openvino) {
         WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
         return 1;
     } else {
@@ -3377,6 +5134,14 @@ int whisper_ctx_init_openvino_encoder(
 #endif
 }
 
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
+}
+
 struct whisper_context_params whisper_context_default_params() {
     struct whisper_context_params result = {
         /*.use_gpu              =*/ true,
@@ -3390,13 +5155,68 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.threadpool_n_spin    =*/ 1 << 16,
+        /*.threadpool_affinity  =*/ false,
+
+        /*.use_mmap             =*/ true,
+        /*.use_mlock            =*/ false,
+        /*.mmap_prefetch        =*/ false,
     };
     return result;
 }
 
+static struct whisper_context * whisper_init_no_state_internal(struct whisper_model_loader * loader, struct whisper_context_params params, whisper_mmap * mapping);
+
+// the model loader reads from the mapping, the weights are then used in place or copied by whisper_model_load()
+static struct whisper_context * whisper_init_from_mmap_no_state(whisper_mmap * mapping, struct whisper_context_params params) {
+    whisper_model_loader loader = {};
+
+    loader.context = mapping;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_mmap * mapping = reinterpret_cast<whisper_mmap *>(ctx);
+
+        size_t size_to_copy = mapping->pos >= mapping->size ? 0 : std::min(read_size, mapping->size - mapping->pos);
+
+        memcpy(output, mapping->addr + mapping->pos, size_to_copy);
+        mapping->pos += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_mmap * mapping = reinterpret_cast<whisper_mmap *>(ctx);
+
+        return mapping->pos >= mapping->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_no_state_internal(&loader, params, mapping);
+}
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
 
+#if !defined(GGML_BIG_ENDIAN)
+    // the tensor data would need to be byte-swapped on big-endian hosts
+    if (params.use_mmap) {
+        whisper_mmap * mapping = whisper_mmap_init(path_model, params.mmap_prefetch);
+        if (mapping) {
+            auto ctx = whisper_init_from_mmap_no_state(mapping, params);
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            }
+
+            return ctx;
+        }
+
+        WHISPER_LOG_WARN("%s: failed to map '%s', reading it instead\n", __func__, path_model);
+    }
+#endif
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
@@ -3470,20 +5290,34 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_no_state_internal(loader, params, nullptr);
+}
+
+// takes ownership of the mapping, if any
+static struct whisper_context * whisper_init_no_state_internal(struct whisper_model_loader * loader, struct whisper_context_params params, whisper_mmap * mapping) {
     ggml_time_init();
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
 
+    ctx->model.mapping = mapping;
+
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
         WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        whisper_mmap_free(ctx->model.mapping);
         delete ctx;
         return nullptr;
     }
 
     loader->close(loader->context);
 
+    if (!whisper_fft_plan_init(ctx->fft_plan, WHISPER_N_FFT)) {
+        WHISPER_LOG_ERROR("%s: failed to create FFT plan\n", __func__);
+        whisper_free(ctx);
+        return nullptr;
+    }
+
     return ctx;
 }
 
@@ -3558,6 +5392,13 @@ struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loa
 
 void whisper_free_state(struct whisper_state * state) {
     if (state) {
+        whisper_worker_pool_free(state->workers);
+
+        if (state->backend && ggml_backend_is_cpu(state->backend)) {
+            ggml_backend_cpu_set_threadpool(state->backend, nullptr);
+        }
+        ggml_threadpool_free(state->threadpool);
+
         kv_cache_free(state->kv_self);
         kv_cache_free(state->kv_cross);
 
@@ -3591,12 +5432,166 @@ void whisper_free_state(struct whisper_state * state) {
     }
 }
 
+struct whisper_encoder_batch * whisper_encoder_batch_init(struct whisper_context * ctx, int n_batch, int wait_ms) {
+#if defined(WHISPER_USE_FLASH_ATTN) || defined(WHISPER_USE_FLASH_FF)
+    if (n_batch > 1) {
+        WHISPER_LOG_WARN("%s: the flash attention / flash FF encoder does not support batching, using n_batch = 1\n", __func__);
+        n_batch = 1;
+    }
+#endif
+
+    whisper_encoder_batch * batch = new whisper_encoder_batch;
+
+    batch->ctx = ctx;
+
+    batch->queue.n_max     = std::max(1, n_batch);
+    batch->queue.t_wait_us = 1000LL*std::max(0, wait_ms);
+
+    batch->backend = whisper_backend_init(ctx->params);
+    if (!batch->backend) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_encoder_batch_free(batch);
+        return nullptr;
+    }
+
+    // measure the largest batch at the full context size
+    {
+        bool ok = whisper_allocr_graph_init(batch->alloc, ctx->backend,
+                [&]() {
+                    std::vector<whisper_kv_cache *> kv_cross(batch->queue.n_max, nullptr);
+                    return whisper_build_graph_encoder_batch(*ctx, *batch, kv_cross, ctx->model.hparams.n_audio_ctx);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init batched encoder allocator\n", __func__);
+            whisper_encoder_batch_free(batch);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (encode, n_batch = %d) = %7.2f MB\n", __func__, batch->queue.n_max, whisper_allocr_size(batch->alloc) / 1e6);
+    }
+
+    return batch;
+}
+
+void whisper_encoder_batch_free(struct whisper_encoder_batch * batch) {
+    if (batch) {
+        if (batch->backend && ggml_backend_is_cpu(batch->backend)) {
+            ggml_backend_cpu_set_threadpool(batch->backend, nullptr);
+        }
+        ggml_threadpool_free(batch->threadpool);
+
+        ggml_gallocr_free(batch->alloc.alloc);
+
+        ggml_backend_free(batch->backend);
+
+        delete batch;
+    }
+}
+
+struct whisper_decoder_batch * whisper_decoder_batch_init(struct whisper_context * ctx, int n_batch, int wait_ms) {
+    whisper_decoder_batch * dbatch = new whisper_decoder_batch;
+
+    dbatch->ctx = ctx;
+
+    dbatch->queue.n_max     = std::max(1, n_batch);
+    dbatch->queue.t_wait_us = 1000LL*std::max(0, wait_ms);
+
+    dbatch->backend = whisper_backend_init(ctx->params);
+    if (!dbatch->backend) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_decoder_batch_free(dbatch);
+        return nullptr;
+    }
+
+    // the attention nodes are repeated for each step in the batch
+    dbatch->n_nodes = WHISPER_MAX_NODES*dbatch->queue.n_max;
+
+    // the compute buffer is allocated on first use, since its size depends on the KV cache usage of the states
+    dbatch->alloc.alloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(ctx->backend));
+    dbatch->alloc.meta.resize(ggml_tensor_overhead()*dbatch->n_nodes + ggml_graph_overhead_custom(dbatch->n_nodes, false));
+
+    return dbatch;
+}
+
+void whisper_decoder_batch_free(struct whisper_decoder_batch * dbatch) {
+    if (dbatch) {
+        if (dbatch->backend && ggml_backend_is_cpu(dbatch->backend)) {
+            ggml_backend_cpu_set_threadpool(dbatch->backend, nullptr);
+        }
+        ggml_threadpool_free(dbatch->threadpool);
+
+        ggml_gallocr_free(dbatch->alloc.alloc);
+
+        ggml_backend_free(dbatch->backend);
+
+        delete dbatch;
+    }
+}
+
+struct whisper_phrases * whisper_phrases_init(struct whisper_context * ctx, const char ** phrases, int n_phrases) {
+    const auto & vocab = ctx->vocab;
+
+    std::vector<std::vector<whisper_token>> tokens(std::max(0, n_phrases));
+
+    for (int i = 0; i < n_phrases; ++i) {
+        tokens[i] = tokenize(vocab, std::string(" ") + phrases[i]);
+
+        if (tokens[i].empty() || *std::max_element(tokens[i].begin(), tokens[i].end()) >= vocab.token_eot) {
+            WHISPER_LOG_ERROR("%s: failed to tokenize phrase %d '%s'\n", __func__, i, phrases[i]);
+            return nullptr;
+        }
+    }
+
+    // sorted and unique, a phrase that tokenizes like an earlier one is never reported
+    std::vector<std::pair<const std::vector<whisper_token> *, int32_t>> keys;
+    keys.reserve(tokens.size());
+    for (int i = 0; i < n_phrases; ++i) {
+        keys.emplace_back(&tokens[i], i);
+    }
+
+    std::sort(keys.begin(), keys.end(), [](const std::pair<const std::vector<whisper_token> *, int32_t> & a, const std::pair<const std::vector<whisper_token> *, int32_t> & b) {
+        return *a.first != *b.first ? *a.first < *b.first : a.second < b.second;
+    });
+    keys.erase(std::unique(keys.begin(), keys.end(), [](const std::pair<const std::vector<whisper_token> *, int32_t> & a, const std::pair<const std::vector<whisper_token> *, int32_t> & b) {
+        return *a.first == *b.first;
+    }), keys.end());
+
+    whisper_phrases * result = new whisper_phrases;
+
+    result->token_eot = vocab.token_eot;
+
+    whisper_trie_build(result->trie, keys);
+
+    WHISPER_LOG_INFO("%s: %d phrases, %d trie nodes\n", __func__, n_phrases, (int) result->trie.nodes.size());
+
+    return result;
+}
+
+void whisper_phrases_free(struct whisper_phrases * phrases) {
+    delete phrases;
+}
+
+int whisper_phrases_match(const struct whisper_phrases * phrases, const whisper_token * tokens, int n_tokens) {
+    int32_t node = 0;
+
+    for (int i = 0; i < n_tokens && node >= 0; ++i) {
+        if (tokens[i] < phrases->token_eot) {
+            node = phrases->trie.next(node, tokens[i]);
+        }
+    }
+
+    return node > 0 ? phrases->trie.nodes[node].id : -1;
+}
+
 void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         ggml_free(ctx->model.ctx);
 
         ggml_backend_buffer_free(ctx->model.buffer);
 
+        whisper_mmap_free(ctx->model.mapping);
+
         whisper_free_state(ctx->state);
 
         ggml_backend_free(ctx->backend);
@@ -3618,7 +5613,7 @@ void whisper_free_params(struct whisper_full_params * params) {
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, ctx->fft_plan, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -3632,7 +5627,13 @@ int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int
 
 // same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2 (PV without phase lock is not good)
 int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+    whisper_fft_plan plan;
+    if (!whisper_fft_plan_init(plan, 2 * WHISPER_N_FFT)) {
+        WHISPER_LOG_ERROR("%s: failed to create FFT plan\n", __func__);
+        return -1;
+    }
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, plan, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
     }
@@ -3683,6 +5684,52 @@ int whisper_set_mel(
     return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
 }
 
+int whisper_stream_mel_reset_with_state(struct whisper_context * ctx, struct whisper_state * state, int len_ms) {
+    log_mel_stream_reset(state->mel_stream, ctx->model.filters, WHISPER_N_FFT, len_ms);
+
+    return 0;
+}
+
+int whisper_stream_mel_reset(struct whisper_context * ctx, int len_ms) {
+    return whisper_stream_mel_reset_with_state(ctx, ctx->state, len_ms);
+}
+
+int whisper_stream_mel_push_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples) {
+    if (state->mel_stream.n_mel == 0) {
+        WHISPER_LOG_ERROR("%s: stream is not initialized, call whisper_stream_mel_reset() first\n", __func__);
+        return -1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    log_mel_stream_push(state->mel_stream, samples, n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters, ctx->fft_plan);
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_stream_mel_push(struct whisper_context * ctx, const float * samples, int n_samples) {
+    return whisper_stream_mel_push_with_state(ctx, ctx->state, samples, n_samples);
+}
+
+int whisper_stream_mel_window_with_state(struct whisper_context * ctx, struct whisper_state * state, int n_samples) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!log_mel_stream_window(state->mel_stream, n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters, ctx->fft_plan, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_stream_mel_window(struct whisper_context * ctx, int n_samples) {
+    return whisper_stream_mel_window_with_state(ctx, ctx->state, n_samples);
+}
+
 int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
     if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
         WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
@@ -3967,6 +6014,17 @@ float * whisper_get_logits_from_state(struct whisper_state * state) {
     return state->logits.data();
 }
 
+const float * whisper_get_mel(struct whisper_context * ctx, int * n_len) {
+    return whisper_get_mel_from_state(ctx->state, n_len);
+}
+
+const float * whisper_get_mel_from_state(struct whisper_state * state, int * n_len) {
+    if (n_len) {
+        *n_len = state->mel.n_len;
+    }
+    return state->mel.data.data();
+}
+
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
     return ctx->vocab.id_to_token.at(token).c_str();
 }
@@ -4483,6 +6541,15 @@ static void whisper_suppress_invalid_grammar(
     //fprintf(stderr, "Allowed: (%zu tokens)\n", size - rejects.size());
 }
 
+// advance the node of a decoder by a sampled token, timestamps and special tokens do not move it
+static void whisper_phrases_accept_token(const whisper_phrases & phrases, int32_t & node, whisper_token token) {
+    if (node < 0 || token >= phrases.token_eot) {
+        return;
+    }
+
+    node = phrases.trie.next(node, token);
+}
+
 static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
     if (grammar.rules.empty() || grammar.stacks.empty()) {
         return;
@@ -4610,6 +6677,11 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.n_grammar_rules =*/ 0,
         /*.i_start_rule    =*/ 0,
         /*.grammar_penalty =*/ 100.0f,
+
+        /*.encoder_batch   =*/ nullptr,
+        /*.decoder_batch   =*/ nullptr,
+
+        /*.phrases         =*/ nullptr,
     };
 
     switch (strategy) {
@@ -4663,67 +6735,218 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
 static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
     auto segment = state.result_all.back();
 
-    int res = 1;
-    int acc = 0;
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+            state.result_all.back().speaker_turn_next = false;
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+// collect the tokens that whisper_process_logits() suppresses regardless of the decoded sequence
+static void whisper_logits_suppress_init(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params) {
+    const auto & vocab = ctx.vocab;
+
+    auto & pre  = state.logits_suppress_pre;
+    auto & post = state.logits_suppress_post;
+
+    pre.clear();
+    post.clear();
+
+    // suppress <|notimestamps|> token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+    pre.push_back(vocab.token_not);
+
+    // suppress sot and nosp tokens
+    pre.push_back(vocab.token_sot);
+    pre.push_back(vocab.token_nosp); // TODO: ignore this token for now
+
+    // [TDRZ] when tinydiarize is disabled, suppress solm token
+    if (params.tdrz_enable == false) {
+        pre.push_back(vocab.token_solm);
+    }
+
+    // suppress task tokens
+    pre.push_back(vocab.token_translate);
+    pre.push_back(vocab.token_transcribe);
+    pre.push_back(vocab.token_prev);
+
+    // suppress lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        pre.push_back(whisper_token_lang(&ctx, i));
+    }
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (params.suppress_regex != nullptr) {
+        std::regex re(params.suppress_regex);
+        for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
+            if (std::regex_match(token_id.first, re)) {
+                post.push_back(token_id.second);
+            }
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_non_speech_tokens) {
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                    post.push_back(vocab.token_to_id.at(suppress_token));
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+            post.push_back(vocab.token_to_id.at(" -"));
+        }
+        if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+            post.push_back(vocab.token_to_id.at(" '"));
+        }
+    }
+
+    // scattered writes in increasing address order
+    std::sort(pre.begin(),  pre.end());
+    std::sort(post.begin(), post.end());
+    post.erase(std::unique(post.begin(), post.end()), post.end());
+}
+
+// the largest of logits[i0, i1) and the first index that holds it
+// the independent lanes let the compiler keep them in one vector register
+static float whisper_logits_max(const float * logits, int i0, int i1, whisper_token & id) {
+    constexpr int n_lanes = 8;
 
-    std::string text;
+    float lanes[n_lanes];
+    for (int k = 0; k < n_lanes; ++k) {
+        lanes[k] = -INFINITY;
+    }
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
+    int i = i0;
+    for (; i + n_lanes <= i1; i += n_lanes) {
+        for (int k = 0; k < n_lanes; ++k) {
+            lanes[k] = logits[i + k] > lanes[k] ? logits[i + k] : lanes[k];
         }
+    }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
-
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
+    float max = -INFINITY;
+    for (int k = 0; k < n_lanes; ++k) {
+        max = lanes[k] > max ? lanes[k] : max;
+    }
+    for (; i < i1; ++i) {
+        max = logits[i] > max ? logits[i] : max;
+    }
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+    id = std::find(logits + i0, logits + i1, max) - logits;
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+    return max;
+}
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+// max, log-sum-exp and timestamp log-sum-exp of the logits in a single pass over the exponentials
+// the sum is accumulated in token order, so lse is the same as the one of a plain log_softmax
+static void whisper_logits_info_compute(
+                 const float * logits,
+                         int   n_logits,
+               whisper_token   token_beg,
+         whisper_logits_info & info) {
+    whisper_token id_text = 0;
+    whisper_token id_ts   = token_beg;
 
-            acc = 0;
-            text = "";
+    const float max_text = whisper_logits_max(logits, 0,         token_beg, id_text);
+    const float max_ts   = whisper_logits_max(logits, token_beg, n_logits,  id_ts);
+    const float max      = std::max(max_text, max_ts);
 
-            segment = state.result_all.back();
-            i = -1;
+    info.max_text = max_text;
+    info.id       = max_text >= max_ts ? id_text : id_ts;
+    info.tid      = id_ts;
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
-        }
+    if (max == -INFINITY) {
+        info.lse    = -INFINITY;
+        info.ts_lse = -INFINITY;
+        return;
     }
 
-    state.result_all.back().text = std::move(text);
+    float sum    = 0.0f;
+    float sum_ts = 0.0f;
 
-    return res;
+    for (int i = 0; i < token_beg; ++i) {
+        sum += expf(logits[i] - max);
+    }
+    for (int i = token_beg; i < n_logits; ++i) {
+        const float e = expf(logits[i] - max);
+        sum    += e;
+        sum_ts += e;
+    }
+
+    info.lse    = logf(sum) + max;
+    info.ts_lse = sum_ts > 0.0f ? logf(sum_ts) + max : -INFINITY;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+static void whisper_logits_fill(float * logits, int i0, int i1) {
+    if (i0 < i1) {
+        std::fill(logits + i0, logits + i1, -INFINITY);
+    }
+}
 
 // process the logits for the selected decoder
+// - copies the logits scaled by the temperature
 // - applies logit filters
-// - computes logprobs and probs
-// TODO: optimize
+// - computes the log-sum-exp, the most probable token and the timestamp probability mass
+// the probability of token i is expf(logits[i] - logits_info.lse), tokens filtered out have -INFINITY logits
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
@@ -4740,22 +6963,21 @@ static void whisper_process_logits(
 
     // extract the logits for the last token
     // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
+    auto & logits = decoder.logits;
+    auto & info   = decoder.logits_info;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+
+        const float * src = state.logits.data() + decoder.i_batch*n_logits;
+              float * dst = logits.data();
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                dst[i] = src[i] / temperature;
             }
+        } else {
+            memcpy(dst, src, n_logits*sizeof(float));
         }
-
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
     }
 
     // apply logit filters here
@@ -4770,71 +6992,32 @@ static void whisper_process_logits(
             }
         }
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
-
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY; // TODO: ignore this token for now
-
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+        // special, task and language tokens - see whisper_logits_suppress_init()
+        for (const whisper_token id : state.logits_suppress_pre) {
+            logits[id] = -INFINITY;
         }
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
-
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
+        // the timestamps are hidden from the logits_filter_callback as well
+        if (params.no_timestamps) {
+            whisper_logits_fill(logits.data(), vocab.token_beg, n_logits);
         }
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
-
         if (params.logits_filter_callback) {
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
+        // suppress_regex and non-speech tokens
+        for (const whisper_token id : state.logits_suppress_post) {
+            logits[id] = -INFINITY;
         }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
+        // the timestamp rules below only allow a range of text tokens and a range of timestamp tokens
+        int text_0 = 0;
+        int ts_0   = vocab.token_beg;
+        int ts_1   = n_logits;
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+        if (params.no_timestamps) {
+            ts_1 = ts_0;
         }
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
@@ -4847,13 +7030,9 @@ static void whisper_process_logits(
 
             if (last_was_timestamp) {
                 if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    ts_1 = ts_0;
                 } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    text_0 = vocab.token_eot;
                 }
             }
         }
@@ -4864,9 +7043,7 @@ static void whisper_process_logits(
             const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
             const int   tid0      = std::round(params.max_initial_ts/precision);
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
+            ts_1 = std::min(ts_1, vocab.token_beg + tid0 + 1);
         }
 
         // condition timestamp tokens to be increasing
@@ -4874,149 +7051,128 @@ static void whisper_process_logits(
         if (decoder.has_ts) {
             const int tid0 = decoder.seek_delta/2;
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
+            ts_0 = std::max(ts_0, std::min(vocab.token_beg + tid0, n_logits));
         }
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
+        // constrain the text to the phrases - see whisper_phrases_init()
+        if (params.phrases && decoder.phrase_node >= 0) {
+            const auto & trie = params.phrases->trie;
+            const auto & node = trie.nodes[decoder.phrase_node];
+
+            const bool is_boundary = decoder.phrase_node == 0 || node.id >= 0;
+
+            // timestamps only before or after a phrase
+            if (!is_boundary) {
+                ts_1 = ts_0;
             }
-            logsumexp = logf(logsumexp) + logit_max;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
+            // only the text tokens that continue the phrase - the children are sorted, so the gaps between them are cleared
+            bool has_text = false;
+            {
+                int i0 = 0;
+                for (int32_t c = node.child; c < node.child + node.n_child; ++c) {
+                    const int id = trie.labels[c];
+
+                    whisper_logits_fill(logits.data(), i0, id);
+                    i0 = id + 1;
+
+                    has_text = has_text || (id >= text_0 && logits[id] != -INFINITY);
                 }
+                whisper_logits_fill(logits.data(), i0, vocab.token_eot);
+            }
+
+            // end of text once a phrase is complete, or if the filters above have left nothing else
+            if (node.id < 0 && (has_text || (is_boundary && ts_0 < ts_1))) {
+                logits[vocab.token_eot] = -INFINITY;
             }
         }
 
+        ts_1 = std::max(ts_0, ts_1);
+
+        whisper_logits_fill(logits.data(), 0,               text_0);
+        whisper_logits_fill(logits.data(), vocab.token_beg, ts_0);
+        whisper_logits_fill(logits.data(), ts_1,            n_logits);
+
+        whisper_logits_info_compute(logits.data(), n_logits, vocab.token_beg, info);
+
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
-
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", info.ts_lse - info.lse, info.max_text - info.lse);
 
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+            if (info.ts_lse > info.max_text) {
+                // the text tokens are dropped without renormalizing the probabilities of the timestamps
+                whisper_logits_fill(logits.data(), 0, vocab.token_beg);
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
+                info.max_text = -INFINITY;
+                info.id       = info.tid;
             } else {
                 if (params.n_grammar_rules > 0) {
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    whisper_logits_info_compute(logits.data(), n_logits, vocab.token_beg, info);
                 }
             }
         }
     }
+}
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
-            }
-        }
+// sample from the probabilities expf(logits[i] - lse) of the processed logits
+// u are the uniform variates of the draws in [0, 1), sorted, and ids receives the token of each
+// the tokens are found in a single pass over the cumulative probabilities, normalized and accumulated
+// in double precision the way std::discrete_distribution does, so one draw of a variate matches dist(rng)
+static void whisper_sample_logits(
+                 const float * logits,
+                         int   n_logits,
+                       float   lse,
+                const double * u,
+               whisper_token * ids,
+                         int   n) {
+    double sum = 0.0;
+    for (int i = 0; i < n_logits; ++i) {
+        sum += expf(logits[i] - lse);
     }
 
-#if 0
-    // print first 100 logits - token string : logit
-    //for (int i = 0; i < 10; i++) {
-    //    const auto token   = vocab.id_to_token.at(i);
-    //    const auto prob    = probs[i];
-    //    const auto logit   = logits[i];
-    //    const auto logprob = logprobs[i];
-    //    printf("%16s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
-    //}
-
-    // print sorted
-    {
-        std::vector<std::pair<float, int>> pairs;
+    int j = 0;
 
-        for (int i = 0; i < n_logits; ++i) {
-            pairs.push_back(std::make_pair(probs[i], i));
+    double cp = 0.0;
+    for (int i = 0; i < n_logits - 1 && j < n; ++i) {
+        cp += expf(logits[i] - lse)/sum;
+        while (j < n && cp >= u[j]) {
+            ids[j++] = i;
         }
+    }
 
-        std::sort(pairs.begin(), pairs.end(), [](const std::pair<float, int>& a, const std::pair<float, int>& b) {
-            return a.first > b.first;
-        });
+    // the last cumulative probability is 1
+    while (j < n) {
+        ids[j++] = n_logits - 1;
+    }
+}
 
-        for (int i = 0; i < 10; i++) {
-            const auto token   = vocab.id_to_token.at(pairs[i].second);
-            const auto prob    = pairs[i].first;
-            const auto logit   = logits[pairs[i].second];
-            const auto logprob = logprobs[pairs[i].second];
-            printf("%16s : id=%6d prob=%9.5f logit=%9.5f logprob=%9.5f '%s'\n", token.c_str(), pairs[i].second, prob, logit, logprob, token.c_str());
-        }
+static double whisper_sample_uniform(std::mt19937 & rng) {
+    return std::generate_canonical<double, std::numeric_limits<double>::digits>(rng);
+}
 
-        printf("----------------\n");
-    }
+// probability of the most likely timestamp token relative to all timestamps, and the timestamps' total probability
+static void whisper_logits_ts_probs(
+           const whisper_decoder & decoder,
+                     whisper_token & tid,
+                             float & pt,
+                             float & ptsum) {
+    const auto & info = decoder.logits_info;
 
-    // "And", "and", " And", " and"
-    //printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    //printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    //printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    //printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    //printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+    if (info.ts_lse == -INFINITY) {
+        pt    = 0.0f;
+        ptsum = 0.0f;
+        return;
+    }
 
-    //printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    //printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    //printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    //printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    //printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+    const double p_max = expf(decoder.logits[info.tid] - info.lse);
+    const double p_sum = expf(info.ts_lse - info.lse);
 
-    //printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    //printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    //printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    //printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    //printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
+    tid   = info.tid;
+    pt    = p_max/(p_sum + 1e-10);
+    ptsum = p_sum;
 }
 
 static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whisper_sequence & b) {
@@ -5042,47 +7198,24 @@ static whisper_token_data whisper_sample_token(
 
     const auto & vocab = ctx.vocab;
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+    const auto & logits = decoder.logits;
+    const auto & info   = decoder.logits_info;
 
     const int n_logits = vocab.n_vocab;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
-
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
-    }
+    whisper_logits_ts_probs(decoder, result.tid, result.pt, result.ptsum);
 
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
-        }
+        result.id = info.id;
     } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        const double u = whisper_sample_uniform(decoder.rng);
 
-        result.id   = dist(decoder.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
+        whisper_sample_logits(logits.data(), n_logits, info.lse, &u, &result.id, 1);
     }
 
+    result.plog = logits[result.id] - info.lse;
+    result.p    = logits[result.id] == -INFINITY ? 0.0f : expf(result.plog);
+
     if (result.id >= vocab.token_beg) {
         result.tid = result.id;
         result.pt  = result.p;
@@ -5091,79 +7224,68 @@ static whisper_token_data whisper_sample_token(
     return result;
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
+// draw k tokens into result, which holds at least k elements
+static void whisper_sample_token_topk(
             whisper_context & ctx,
             whisper_decoder & decoder,
-                        int   k) {
+                        int   k,
+         whisper_token_data * result) {
     const auto & vocab = ctx.vocab;
 
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
+    const auto & logits = decoder.logits;
+    const auto & info   = decoder.logits_info;
 
     const int n_logits = vocab.n_vocab;
 
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
-
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
-
     whisper_token tid = vocab.token_beg;
 
     float pt    = 0.0;
     float ptsum = 0.0;
 
+    whisper_logits_ts_probs(decoder, tid, pt, ptsum);
+
+    // draw the variates in order, then find all tokens in one pass over the sorted variates
+    auto & draws = decoder.logits_id;
+
+    draws.resize(k);
+    for (int i = 0; i < k; ++i) {
+        draws[i].first  = whisper_sample_uniform(decoder.rng);
+        draws[i].second = i;
+    }
+
     {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+        using pair_type = std::remove_reference<decltype(draws)>::type::value_type;
+        std::sort(draws.begin(), draws.end(), [](const pair_type & a, const pair_type & b) {
+            return a.first < b.first;
+        });
+    }
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+    WHISPER_ASSERT(k <= WHISPER_MAX_DECODERS);
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
+    double        u  [WHISPER_MAX_DECODERS];
+    whisper_token ids[WHISPER_MAX_DECODERS];
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
+    for (int i = 0; i < k; ++i) {
+        u[i] = draws[i].first;
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    whisper_sample_logits(logits.data(), n_logits, info.lse, u, ids, k);
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
-        //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
+        const whisper_token id = ids[i];
+
+        const float plog = logits[id] - info.lse;
+        const float p    = logits[id] == -INFINITY ? 0.0f : expf(plog);
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
+        auto & token = result[draws[i].second];
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
+        token = { id, tid, p, plog, pt, ptsum, -1, -1, -1, 0.0f, };
+
+        if (token.id >= vocab.token_beg) {
+            token.tid = token.id;
+            token.pt  = token.p;
         }
     }
-
-    return result;
 }
 
 // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
@@ -5316,9 +7438,7 @@ int whisper_full_with_state(
 
         decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
 
-        decoder.probs.resize   (ctx->vocab.n_vocab);
         decoder.logits.resize  (ctx->vocab.n_vocab);
-        decoder.logprobs.resize(ctx->vocab.n_vocab);
         decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
 
         decoder.rng = std::mt19937(0);
@@ -5391,23 +7511,50 @@ int whisper_full_with_state(
         prompt_init.push_back(whisper_token_not(ctx));
     }
 
+    whisper_logits_suppress_init(*ctx, *state, params);
+
     int seek = seek_start;
 
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // the prompt whose KV cells are held by decoder 0 at positions [0, prompt_cached.size())
+    // the cells attend to the encoder output, so they are only reusable until the next encode
+    std::vector<whisper_token> prompt_cached;
+    prompt_cached.reserve(whisper_n_text_ctx(ctx));
+
+    // a beam candidate is the sequence of its decoder extended by one token
+    // the sequence itself stays with the decoder and is only copied if the beam forks
     struct beam_candidate {
         int decoder_idx;
+        int rank; // position in the top-k of the decoder
+
+        whisper_token_data token;
+
+        double sum_logprobs_all;
+    };
+
+    // the state of a decoder that is taken over by other decoders, see the beam-search reassignment below
+    struct beam_state {
         int seek_delta;
 
         bool has_ts;
 
+        int32_t phrase_node;
+
         whisper_sequence sequence;
         whisper_grammar grammar;
     };
 
-    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
+    // candidates of decoder j are at [j*WHISPER_MAX_DECODERS, j*WHISPER_MAX_DECODERS + n_bc_per_dec[j])
+    std::vector<beam_candidate> bc_per_dec(n_decoders*WHISPER_MAX_DECODERS);
+    std::vector<int> n_bc_per_dec(n_decoders, 0);
+
     std::vector<beam_candidate> beam_candidates;
+    beam_candidates.reserve(bc_per_dec.size());
+
+    // kept across steps, so that the moved-out sequences reuse their storage
+    std::vector<beam_state> beam_states(n_decoders);
 
     // main loop
     while (true) {
@@ -5431,11 +7578,22 @@ int whisper_full_with_state(
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        bool ok_encode = false;
+        {
+            whisper_batch_queue_member<whisper_encoder_batch::window> encoder_member(params.encoder_batch ? &params.encoder_batch->queue : nullptr);
+
+            ok_encode = params.encoder_batch
+                ? whisper_encoder_batch_eval(*params.encoder_batch, *ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)
+                : whisper_encode_internal   (*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+        }
+
+        if (!ok_encode) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
 
+        prompt_cached.clear();
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -5447,6 +7605,9 @@ int whisper_full_with_state(
         for (int it = 0; it < (int) temperatures.size(); ++it) {
             const float t_cur = temperatures[it];
 
+            // the decoding steps of this attempt - from the prompt to the last token - are batched with the other calls
+            whisper_batch_queue_member<whisper_decoder_batch::step> decoder_member(params.decoder_batch ? &params.decoder_batch->queue : nullptr);
+
             int n_decoders_cur = 1;
 
             switch (params.strategy) {
@@ -5488,6 +7649,8 @@ int whisper_full_with_state(
                 decoder.completed = false;
                 decoder.has_ts    = false;
 
+                decoder.phrase_node = 0;
+
                 if (params.grammar_rules != nullptr) {
                     decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
                 } else {
@@ -5496,7 +7659,7 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
+            // a temperature fallback reuses the KV cells of the prompt prefix it shares with the previous attempt
             {
                 prompt.clear();
 
@@ -5518,11 +7681,30 @@ int whisper_full_with_state(
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
-                whisper_kv_cache_clear(state->kv_self);
+                // at least the last token is decoded again to get its logits
+                int n_keep = 0;
+                while (n_keep < (int) prompt_cached.size() && n_keep < (int) prompt.size() - 1 && prompt_cached[n_keep] == prompt[n_keep]) {
+                    n_keep++;
+                }
+
+                if (n_keep > 0) {
+                    whisper_kv_cache_seq_keep(state->kv_self, 0);
+                    whisper_kv_cache_seq_rm  (state->kv_self, 0, n_keep, -1);
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+                }
+
+                prompt_cached = prompt;
+
+                WHISPER_LOG_DEBUG("%s: reusing %d of %d prompt tokens\n", __func__, n_keep, (int) prompt.size());
+
+                whisper_batch_prep_legacy(state->batch, prompt.data() + n_keep, prompt.size() - n_keep, n_keep, 0);
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                const bool ok_decode = params.decoder_batch
+                    ? whisper_decoder_batch_eval(*params.decoder_batch, *ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)
+                    : whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                if (!ok_decode) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                     return -7;
                 }
@@ -5530,7 +7712,7 @@ int whisper_full_with_state(
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+                    state->decoders[0].i_batch = prompt.size() - n_keep - 1;
 
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
@@ -5539,9 +7721,9 @@ int whisper_full_with_state(
 
                         whisper_kv_cache_seq_cp(state->kv_self, 0, j, -1, -1);
 
-                        memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(), decoder.logits.size()*sizeof(decoder.logits[0]));
+
+                        decoder.logits_info = state->decoders[0].logits_info;
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -5551,14 +7733,10 @@ int whisper_full_with_state(
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    for (auto & bc : bc_per_dec) {
-                        bc.clear();
-                    }
-                }
+                std::fill(n_bc_per_dec.begin(), n_bc_per_dec.end(), 0);
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // the decoders are shared out among the persistent workers of the state
                 {
                     std::atomic<int> j_cur(0);
 
@@ -5589,13 +7767,21 @@ int whisper_full_with_state(
                                     } break;
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                                     {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+                                        const int k = params.beam_search.beam_size;
 
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                        whisper_token_data tokens_new[WHISPER_MAX_DECODERS];
+                                        whisper_sample_token_topk(*ctx, decoder, k, tokens_new);
+
+                                        for (int l = 0; l < k; ++l) {
+                                            auto & cand = bc_per_dec[j*WHISPER_MAX_DECODERS + l];
+
+                                            cand.decoder_idx      = j;
+                                            cand.rank             = l;
+                                            cand.token            = tokens_new[l];
+                                            cand.sum_logprobs_all = decoder.sequence.sum_logprobs_all + tokens_new[l].plog;
                                         }
+
+                                        n_bc_per_dec[j] = k;
                                     } break;
                             };
                         }
@@ -5603,48 +7789,75 @@ int whisper_full_with_state(
 
                     const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    whisper_worker_pool_run(state->workers, n_threads, [&](int) { process(); });
                 }
 
                 beam_candidates.clear();
-                for (const auto & bc : bc_per_dec) {
-                    beam_candidates.insert(beam_candidates.end(), bc.begin(), bc.end());
+                for (int j = 0; j < n_decoders; ++j) {
+                    for (int l = 0; l < n_bc_per_dec[j]; ++l) {
+                        beam_candidates.push_back(bc_per_dec[j*WHISPER_MAX_DECODERS + l]);
+                    }
 
-                    if (!bc.empty()) {
+                    if (n_bc_per_dec[j] > 0) {
                         state->n_sample += 1;
                     }
                 }
 
                 // for beam-search, choose the top candidates and update the KV caches
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
+                    const auto beam_candidate_cmp = [](const beam_candidate & a, const beam_candidate & b) {
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
+                        }
+                        if (a.decoder_idx != b.decoder_idx) {
+                            return a.decoder_idx < b.decoder_idx;
+                        }
+                        return a.rank < b.rank;
+                    };
+
+                    // same as comparing the extended sequences, without building them
+                    const auto beam_candidate_equal = [&](const beam_candidate & a, const beam_candidate & b) {
+                        return a.token.id == b.token.id &&
+                            (a.decoder_idx == b.decoder_idx ||
+                             whisper_sequence_tokens_equal(state->decoders[a.decoder_idx].sequence, state->decoders[b.decoder_idx].sequence));
+                    };
+
+                    int n_active = 0;
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (!state->decoders[j].completed && !state->decoders[j].failed) {
+                            n_active++;
+                        }
+                    }
+
+                    // only the best n_active candidates are ordered up front
+                    // the rest is sorted only if duplicates have to be skipped past them
+                    size_t n_sorted = std::min<size_t>(n_active, beam_candidates.size());
+
+                    std::partial_sort(
                             beam_candidates.begin(),
+                            beam_candidates.begin() + n_sorted,
                             beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                            beam_candidate_cmp);
+
+                    const auto beam_candidate_at = [&](size_t idx) -> const beam_candidate & {
+                        if (idx >= n_sorted) {
+                            std::sort(beam_candidates.begin() + n_sorted, beam_candidates.end(), beam_candidate_cmp);
+                            n_sorted = beam_candidates.size();
                         }
-                        return a.decoder_idx < b.decoder_idx;
-                    });
+                        return beam_candidates[idx];
+                    };
+
+                    // the candidate chosen by each decoder, -1 for the decoders that are done
+                    beam_candidate   beam_chosen[WHISPER_MAX_DECODERS];
+                    whisper_seq_id   beam_src   [WHISPER_MAX_DECODERS];
+                    bool             beam_is_src[WHISPER_MAX_DECODERS] = { false };
 
                     uint32_t cur_c = 0;
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        const auto & decoder = state->decoders[j];
+
+                        beam_src[j] = -1;
 
                         if (decoder.completed || decoder.failed) {
                             continue;
@@ -5654,34 +7867,92 @@ int whisper_full_with_state(
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        const auto & cur = beam_candidate_at(cur_c++);
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && i > 0 && beam_candidate_equal(beam_candidate_at(cur_c), cur)) {
                             ++cur_c;
                         }
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+                        beam_chosen[j] = cur;
+                        beam_src[j]    = cur.decoder_idx;
+
+                        beam_is_src[cur.decoder_idx] = true;
+                    }
 
-                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                    // hand the sequences over to the decoders that continue them:
+                    // - a decoder that continues its own sequence keeps it in place
+                    // - the sequences of the decoders that are taken over are moved out first,
+                    //   the first decoder continuing such a sequence gets it moved and the others copy it
+                    int beam_owner[WHISPER_MAX_DECODERS];
 
-                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        beam_owner[j] = -1;
+
+                        if (!beam_is_src[j]) {
+                            continue;
+                        }
+
+                        if (beam_src[j] == j) {
+                            beam_owner[j] = j;
+                            continue;
+                        }
+
+                        auto & decoder = state->decoders[j];
+                        auto & bs      = beam_states[j];
+
+                        bs.seek_delta  = decoder.seek_delta;
+                        bs.has_ts      = decoder.has_ts;
+                        bs.phrase_node = decoder.phrase_node;
+                        std::swap(bs.sequence, decoder.sequence);
+                        std::swap(bs.grammar,  decoder.grammar);
                     }
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
+                        const int src = beam_src[j];
+
+                        if (src < 0 || src == j) {
+                            continue;
+                        }
+
                         auto & decoder = state->decoders[j];
 
-                        if (decoder.completed || decoder.failed) {
+                        if (beam_owner[src] < 0) {
+                            auto & bs = beam_states[src];
+
+                            decoder.seek_delta  = bs.seek_delta;
+                            decoder.has_ts      = bs.has_ts;
+                            decoder.phrase_node = bs.phrase_node;
+                            std::swap(decoder.sequence, bs.sequence);
+                            std::swap(decoder.grammar,  bs.grammar);
+
+                            beam_owner[src] = j;
+                        } else {
+                            const auto & owner = state->decoders[beam_owner[src]];
+
+                            decoder.seek_delta  = owner.seek_delta;
+                            decoder.has_ts      = owner.has_ts;
+                            decoder.phrase_node = owner.phrase_node;
+                            decoder.sequence   = owner.sequence;
+                            decoder.grammar    = owner.grammar;
+                        }
+                    }
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        if (beam_src[j] < 0) {
                             continue;
                         }
 
-                        whisper_kv_cache_seq_rm(state->kv_self, j,                           -1, -1);
-                        whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
-                        whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
+                        auto & decoder = state->decoders[j];
+                        const auto & cur = beam_chosen[j];
+
+                        decoder.sequence.tokens.push_back(cur.token);
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+
+                        WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(cur.token.id).c_str(), cur.token.plog, cur.sum_logprobs_all);
                     }
+
+                    whisper_kv_cache_seq_remap(state->kv_self, beam_src, n_decoders_cur);
                 }
 
                 // update the decoder state
@@ -5722,6 +7993,10 @@ int whisper_full_with_state(
 
                         whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
 
+                        if (params.phrases) {
+                            whisper_phrases_accept_token(*params.phrases, decoder.phrase_node, token.id);
+                        }
+
 #ifdef WHISPER_DEBUG
                         {
                             const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
@@ -5822,14 +8097,18 @@ int whisper_full_with_state(
 
                     assert(batch.n_tokens > 0);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                    const bool ok_decode = params.decoder_batch
+                        ? whisper_decoder_batch_eval(*params.decoder_batch, *ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)
+                        : whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data);
+
+                    if (!ok_decode) {
                         WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                         return -8;
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // process the logits of the decoders on the persistent workers of the state
                     {
                         std::atomic<int> j_cur(0);
 
@@ -5853,21 +8132,7 @@ int whisper_full_with_state(
 
                         const int n_threads = std::min(params.n_threads, n_decoders_cur);
 
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                        whisper_worker_pool_run(state->workers, n_threads, [&](int) { process(); });
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
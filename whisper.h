@@ -78,6 +78,9 @@ extern "C" {
 
     struct whisper_context;
     struct whisper_state;
+    struct whisper_encoder_batch;
+    struct whisper_decoder_batch;
+    struct whisper_phrases;
     struct whisper_full_params;
 
     typedef int32_t whisper_pos;
@@ -123,6 +126,17 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        // persistent compute threads of each whisper_state (CPU backend)
+        int  threadpool_n_spin;   // number of polls an idle thread spins before going to sleep
+        bool threadpool_affinity; // pin the compute threads to CPUs
+
+        // map the model file instead of reading it (whisper_init_from_file*)
+        // with the CPU backend, the weights are used in place if the tensor data in the file is aligned
+        // (see models/convert-ggml-to-aligned.py), so processes loading the same file share its pages
+        bool use_mmap;
+        bool use_mlock;     // lock the mapped weights in memory
+        bool mmap_prefetch; // read the whole file into the page cache while loading
     };
 
     typedef struct whisper_token_data {
@@ -243,6 +257,46 @@ extern "C" {
                     const char * device,
                     const char * cache_dir);
 
+    // Same as whisper_ctx_init_openvino_encoder, but the encoder is attached to the provided state
+    WHISPER_API int whisper_ctx_init_openvino_encoder_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir);
+
+    // [EXPERIMENTAL] Batched encoder
+    // Concurrent whisper_full_with_state() calls on different states of the same context that pass the
+    // same batch in whisper_full_params.encoder_batch have their encoder windows evaluated together,
+    // up to n_batch windows in one graph. The first caller of an idle batch waits up to wait_ms for
+    // the windows of the other calls that are currently encoding before it starts the computation.
+    // The batch must be freed before the context.
+    WHISPER_API struct whisper_encoder_batch * whisper_encoder_batch_init(struct whisper_context * ctx, int n_batch, int wait_ms);
+    WHISPER_API void whisper_encoder_batch_free(struct whisper_encoder_batch * batch);
+
+    // [EXPERIMENTAL] Continuous batching of the text decoder
+    // Same as the batched encoder, but for the decoding steps: the next-token steps of concurrent
+    // whisper_full_with_state() calls sharing the batch are evaluated in one graph, up to n_batch steps.
+    // Calls join and leave the batch at every step, so a new request does not wait for the running ones
+    // to finish, and a step only waits for the calls that are decoding, not for those that are encoding
+    // or between windows. Prompts and DTW token timestamps are still evaluated per state.
+    // The batch must be freed before the context.
+    WHISPER_API struct whisper_decoder_batch * whisper_decoder_batch_init(struct whisper_context * ctx, int n_batch, int wait_ms);
+    WHISPER_API void whisper_decoder_batch_free(struct whisper_decoder_batch * batch);
+
+    // Constrained decoding to a list of phrases
+    // The phrases are tokenized once, with a leading space as they follow the prompt, and compiled into a
+    // trie of tokens. With whisper_full_params.phrases set, each decoding pass spells exactly one phrase:
+    // only the tokens that continue a phrase can be sampled, end of text only once a phrase is complete,
+    // and timestamp tokens only before or after it.
+    // Returns nullptr if a phrase cannot be tokenized. The phrases do not depend on the context after init.
+    WHISPER_API struct whisper_phrases * whisper_phrases_init(struct whisper_context * ctx, const char ** phrases, int n_phrases);
+    WHISPER_API void whisper_phrases_free(struct whisper_phrases * phrases);
+
+    // Index of the phrase spelled by the text tokens, e.g. of a segment, -1 if it is not a phrase
+    // Timestamp and special tokens are ignored
+    WHISPER_API int whisper_phrases_match(const struct whisper_phrases * phrases, const whisper_token * tokens, int n_tokens);
+
     // Frees all allocated memory
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
@@ -281,6 +335,49 @@ extern "C" {
                            int   n_samples,
                            int   n_threads);
 
+    // Incremental log mel spectrogram for streaming input.
+    // Samples passed to whisper_stream_mel_push() are appended to a running stream and only the frames
+    // that became complete are transformed. The raw columns are kept in a ring holding up to len_ms of audio.
+    // whisper_stream_mel_window() then stores the spectrogram of about the last n_samples pushed samples inside
+    // the state, so whisper_full() can be called with n_samples == 0.
+    // The result approximates whisper_pcm_to_mel() on those samples. It differs in the following ways:
+    //  - the start of the window is rounded up to the 160-sample frame grid of the stream, dropping up to
+    //    159 of the oldest samples
+    //  - the first columns of the window see the earlier audio of the stream as their left context, instead
+    //    of the 200-sample reflective padding of whisper_pcm_to_mel()
+    //  - the very start of the stream is zero-padded, not reflect-padded
+    //  - the normalization follows the columns of the window, so it changes with the above columns as well
+    // The columns that do not overlap the start of the window match whisper_pcm_to_mel() up to rounding.
+    // The stream is (re)initialized by whisper_stream_mel_reset(). Returns 0 on success
+    WHISPER_API int whisper_stream_mel_reset(
+            struct whisper_context * ctx,
+                               int   len_ms);
+
+    WHISPER_API int whisper_stream_mel_reset_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   len_ms);
+
+    WHISPER_API int whisper_stream_mel_push(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples);
+
+    WHISPER_API int whisper_stream_mel_push_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples);
+
+    WHISPER_API int whisper_stream_mel_window(
+            struct whisper_context * ctx,
+                               int   n_samples);
+
+    WHISPER_API int whisper_stream_mel_window_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   n_samples);
+
     // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -410,6 +507,11 @@ extern "C" {
     WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
     WHISPER_API float * whisper_get_logits_from_state(struct whisper_state * state);
 
+    // The log mel spectrogram stored in the state, e.g. by whisper_pcm_to_mel() or whisper_stream_mel_window()
+    // Rows: n_mel, each of *n_len columns, including the padding frames after the audio
+    WHISPER_API const float * whisper_get_mel           (struct whisper_context * ctx, int * n_len);
+    WHISPER_API const float * whisper_get_mel_from_state(struct whisper_state * state, int * n_len);
+
     // Token Id -> String. Uses the vocabulary in the provided context
     WHISPER_API const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token);
     WHISPER_API const char * whisper_model_type_readable(struct whisper_context * ctx);
@@ -569,6 +671,17 @@ extern "C" {
         size_t                           n_grammar_rules;
         size_t                           i_start_rule;
         float                            grammar_penalty;
+
+        // [EXPERIMENTAL] evaluate the encoder together with concurrent calls sharing the same batch
+        // see whisper_encoder_batch_init()
+        struct whisper_encoder_batch * encoder_batch;
+
+        // [EXPERIMENTAL] evaluate the decoding steps together with concurrent calls sharing the same batch
+        // see whisper_decoder_batch_init()
+        struct whisper_decoder_batch * decoder_batch;
+
+        // constrain the decoded text to one of the phrases, see whisper_phrases_init()
+        const struct whisper_phrases * phrases;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()